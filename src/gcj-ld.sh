@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Run the compiler, and link the binary it outputs into the database
+# so browsing it starts without linking.
+#
+#   gcj-ld.sh db compiler args...
+#
+# Set $GCJ_LINK_BACKGROUND to link in the background and return as
+# soon as the compiler does.
+
+db=$1
+shift
+
+out=a.out
+link=1
+prev=
+for arg in "$@"; do
+  if [ "$prev" = -o ]; then
+    out=$arg
+  else
+    case "$arg" in
+      -c|-S|-E|-M|-MM) link= ;;
+      -o?*) out=${arg#-o} ;;
+    esac
+  fi
+  prev=$arg
+done
+
+# The output is linked only if the compiler writes it, not a stale
+# one left by another run, e.g. of gcc --version
+stamp () {
+  stat -c '%d %i %s %y' -- "$1" 2>/dev/null
+}
+before=$(stamp "$out")
+"$@" || exit
+
+# Compiling only, or not a binary with units
+[ -n "$link" ] && [ -f "$out" ] && [ "$(stamp "$out")" != "$before" ] \
+  || exit 0
+# Nor the tests of configure
+case "$(basename "$out")" in
+  conftest*) exit 0 ;;
+esac
+
+gcj=$(dirname "$0")/gcj
+if [ -n "$GCJ_LINK_BACKGROUND" ]; then
+  "$gcj" "$db" link "$out" </dev/null >/dev/null 2>&1 &
+else
+  "$gcj" "$db" link "$out" || true
+fi
+exit 0
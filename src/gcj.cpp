@@ -1,7 +1,20 @@
 #include <limits.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sstream>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <queue>
 
 #include "gcj.hpp"
 
@@ -60,6 +73,24 @@ load_string (FILE* fp, std::string* str)
   *str = std::string (buf, size);
 }
 
+// Write to a temporary file and rename it, so concurrent readers
+// and writers of the same path never see a partial file
+static FILE*
+open_save (const std::string& path, std::string* tmp)
+{
+  *tmp = path + ".tmp." + tostr (getpid ());
+  FILE* fp = fopen (tmp->c_str (), "wb");
+  assert (fp);
+  return fp;
+}
+
+static void
+close_save (FILE* fp, const std::string& path, const std::string& tmp)
+{
+  assert (fclose (fp) == 0);
+  assert (rename (tmp.c_str (), path.c_str ()) == 0);
+}
+
 static void
 iprintf (FILE* fp, int i, const char* fmt, ...)
 {
@@ -72,70 +103,130 @@ iprintf (FILE* fp, int i, const char* fmt, ...)
   va_end (ap);
 }
 
+// Strings of a unit file, each saved once and referred by offset
+struct string_pool
+{
+  int
+  get (const std::string& str)
+  {
+    std::map<std::string, int>::iterator it = offsets.find (str);
+    if (it != offsets.end ())
+      return it->second;
+
+    int offset = data.size ();
+    data.append (str.c_str (), str.size () + 1);
+    offsets.insert (std::make_pair (str, offset));
+    return offset;
+  }
+
+  std::map<std::string, int> offsets;
+  std::string data;
+};
+
+// A section of a unit file being saved
+struct section_writer
+{
+  section_writer ()
+    : pool (NULL)
+  {
+  }
+
+  std::string data;
+  string_pool* pool;
+};
+
+// A section of a mapped unit file
+struct section_reader
+{
+  section_reader (const char* p, const char* end, const unit_file* file)
+    : p (p), end (end), file (file)
+  {
+  }
+
+  const char* p;
+  const char* end;
+  // Strings are read from the string pool of the file
+  const unit_file* file;
+};
+
 static void
-save_file_location (FILE* fp, const file_location& loc)
+save_raw (section_writer* sec, const void* v, size_t size)
 {
-  save_int32 (fp, loc.line);
-  save_int32 (fp, loc.col);
+  sec->data.append ((const char*) v, size);
 }
 
 static void
-load_file_location (FILE* fp, file_location* loc)
+save_int32 (section_writer* sec, int v)
 {
-  load_int32 (fp, &loc->line);
-  load_int32 (fp, &loc->col);
+  int32_t i = v;
+  save_raw (sec, &i, sizeof i);
 }
 
 static void
-save_source_location (FILE* fp, const source_location& loc)
+save_int32r (section_writer* sec, const int& v)
 {
-  save_int32 (fp, loc.fid);
-  save_file_location (fp, loc.loc);
+  save_int32 (sec, v);
 }
 
 static void
-load_source_location (FILE* fp, source_location* loc)
+save_string (section_writer* sec, const std::string& str)
 {
-  load_int32 (fp, &loc->fid);
-  load_file_location (fp, &loc->loc);
+  save_int32 (sec, sec->pool->get (str));
 }
 
 static void
-save_source_stack (FILE* fp, const source_stack& stack)
+load_int32 (section_reader* sec, int* v)
 {
-  save_int32 (fp, stack.locs.size ());
-  std::vector<source_location>::const_iterator it;
-  for (it = stack.locs.begin ();
-       it != stack.locs.end ();
-       ++ it)
-    save_source_location (fp, *it);
+  assert (sec->p + sizeof (int32_t) <= sec->end);
+  int32_t i;
+  memcpy (&i, sec->p, sizeof i);
+  sec->p += sizeof i;
+  *v = i;
 }
 
 static void
-load_source_stack (FILE* fp, source_stack* stack)
+load_string (section_reader* sec, std::string* str)
 {
-  int size;
-  load_int32 (fp, &size);
-  for (int i = 0; i < size; ++ i)
-    {
-      source_location loc;
-      load_source_location (fp, &loc);
-      stack->locs.push_back (loc);
-    }
+  int offset;
+  load_int32 (sec, &offset);
+  *str = sec->file->string (offset);
+}
+
+static void
+save_file_location (section_writer* sec, const file_location& loc)
+{
+  save_int32 (sec, loc.line);
+  save_int32 (sec, loc.col);
+}
+
+static void
+load_file_location (section_reader* sec, file_location* loc)
+{
+  load_int32 (sec, &loc->line);
+  load_int32 (sec, &loc->col);
+}
+
+static void
+save_source_stack (section_writer* sec, const source_stack& stack)
+{
+  save_int32 (sec, stack.fid);
+  save_file_location (sec, stack.loc);
+  save_int32 (sec, stack.parent);
 }
 
 static void
-save_expansion_point (FILE* fp, const expansion_point& point)
+load_source_stack (section_reader* sec, source_stack* stack)
 {
-  save_int32 (fp, point.include);
-  save_source_location (fp, point.loc);
+  load_int32 (sec, &stack->fid);
+  load_file_location (sec, &stack->loc);
+  load_int32 (sec, &stack->parent);
 }
 
 static void
-load_expansion_point (FILE* fp, expansion_point* point)
+save_expansion_point (section_writer* sec, const expansion_point& point)
 {
-  load_int32 (fp, &point->include);
-  load_source_location (fp, &point->loc);
+  save_int32 (sec, point.include);
+  save_file_location (sec, point.loc);
 }
 
 void
@@ -154,6 +245,59 @@ add_back (int unit_id, int include, int point,
   ctx->back (back_from, back_to);
 }
 
+static bool
+back_edge_less (const back_edge& lhs, const back_edge& rhs)
+{
+  if (lhs.to.include != rhs.to.include)
+    return lhs.to.include < rhs.to.include;
+  if (lhs.to.point != rhs.to.point)
+    return lhs.to.point < rhs.to.point;
+  return jump_from (lhs.to.loc, 0, lhs.to.expanded_id)
+	 < jump_from (rhs.to.loc, 0, rhs.to.expanded_id);
+}
+
+// Same as add_back for each edge, but sorted by the contexts and
+// locations they go back from, so each context is looked up once
+// and the backs of a location are merged at once. The sort is
+// stable to keep the len of the first reference like add_back does.
+void
+add_backs (std::vector<back_edge>* edges, unit* to_unit)
+{
+  std::stable_sort (edges->begin (), edges->end (), back_edge_less);
+
+  context* ctx = NULL;
+  std::vector<back_edge>::const_iterator it, end;
+  for (it = edges->begin (); it != edges->end (); it = end)
+    {
+      if (it == edges->begin ()
+	  || it->to.include != (it - 1)->to.include
+	  || it->to.point != (it - 1)->to.point)
+	ctx = it->to.point
+	      ? to_unit->get (it->to.include, it->to.point)
+	      : to_unit->get (it->to.include);
+      assert (! ctx->frozen);
+
+      jump_from back_from (it->to.loc, it->from.len, it->to.expanded_id);
+      std::vector<jump_to>* tos;
+      tos = &ctx->backs.insert (std::make_pair (back_from,
+						std::vector<jump_to> ()))
+	       .first->second;
+
+      size_t size = tos->size ();
+      for (end = it;
+	   end != edges->end () && ! back_edge_less (*it, *end);
+	   ++ end)
+	tos->push_back (jump_to (end->unit, end->include, end->point,
+				 end->from.loc, end->from.expanded_id));
+
+      std::sort (tos->begin () + size, tos->end ());
+      std::inplace_merge (tos->begin (), tos->begin () + size, tos->end ());
+      tos->erase (std::unique (tos->begin (), tos->end ()), tos->end ());
+    }
+
+  edges->clear ();
+}
+
 static void print_jump_from (FILE* fp, const jump_from& from);
 static void print_jump_to (FILE* fp, const jump_to& to);
 
@@ -164,99 +308,217 @@ add_back2 (const context* ctx, const jump_from& from,
 	   unit* to_unit, const jump_to& to)
 {
   if (! ctx) return;
-  const std::set<jump_to>* bks;
-  bks = ctx->jump_back (from.loc, from.expanded_id);
-  if (! bks) return;
-  std::set<jump_to>::const_iterator it;
-  for (it = bks->begin (); it != bks->end (); ++ it)
+  jump_backs bks = ctx->jump_back (from.loc, from.expanded_id);
+  for (const jump_to* it = bks.first; it != bks.last; ++ it)
     add_back (it->unit, it->include, it->point,
 	      gcj::jump_from (it->loc, from.len,
 			      it->expanded_id),
 	      to_unit, to);
 }
 
-const jump_to*
-context::jump (const unit* unit,
-	       const file_location& loc, int expanded_id,
-	       file_location* begin) const
+const context*
+context::expansion (int point) const
 {
-  jump_from from (loc, 0, expanded_id);
-  std::map<jump_from, jump_to>::const_iterator it;
-  it = jumps.upper_bound (from);
-  if (it == jumps.begin ())
-    goto search_surrounding;
-  -- it;
+  if (frozen)
+    {
+      std::vector<int>::const_iterator it;
+      it = std::lower_bound (expansion_ids.begin (), expansion_ids.end (),
+			     point);
+      return it == expansion_ids.end () || *it != point
+	     ? NULL : &expansion_list[it - expansion_ids.begin ()];
+    }
 
-  if (expanded_id != 0
-      && (it->first.loc != loc || it->first.expanded_id != expanded_id))
-    goto search_surrounding;
-
-  // TODO: see how to improve this.
-  // This is so because currently we both have jumps directly for
-  // the tokens in the source code in the format of loc,col,len,0
-  // and for the tokens expanded from macro in the format of
-  // loc,col,0,exp_id and we sort it by loc,col,exp_id. The key is
-  // unique, but creates a wrong order in looking up by a location
-  // in the middle of the token in the form loc,col+n,0,0 where n
-  // is not 0 but less than len. In such case, the result is
-  // pointed to the largest loc,col,0,exp_id where exp_id may not
-  // be 0.
-  if (expanded_id == 0 && it->first.expanded_id != 0)
-    {
-      it = jumps.upper_bound (jump_from (it->first.loc, 0, 0));
-      if (it == jumps.begin ())
-	goto search_surrounding;
-      -- it;
+  std::map<int, context>::const_iterator it;
+  it = expansion_contexts.find (point);
+  return it == expansion_contexts.end () ? NULL : &it->second;
+}
+
+void
+context::expansions (std::vector<std::pair<int, const context*> >* ctxs)
+  const
+{
+  if (frozen)
+    for (size_t i = 0; i < expansion_ids.size (); ++ i)
+      ctxs->push_back (std::make_pair (expansion_ids[i],
+				       &expansion_list[i]));
+  else
+    {
+      std::map<int, context>::const_iterator it;
+      for (it = expansion_contexts.begin ();
+	   it != expansion_contexts.end ();
+	   ++ it)
+	ctxs->push_back (std::make_pair (it->first, &it->second));
     }
+}
 
-  if (expanded_id == 0
-      && (it->first.loc.line != loc.line
-	  || (it->first.loc.col
-	      && it->first.loc.col + it->first.len <= loc.col)))
-    goto search_surrounding;
+void
+context::back (const jump_from& from, const jump_to& to)
+{
+  assert (! frozen);
+  std::vector<jump_to>* tos = &backs[from];
+  std::vector<jump_to>::iterator it;
+  it = std::lower_bound (tos->begin (), tos->end (), to);
+  if (it == tos->end () || to < *it)
+    tos->insert (it, to);
+}
 
-  if (expanded_id == 0 && begin)
-    *begin = it->first.loc;
-  return &it->second;
+// The first of the n keys greater than, or not less than if
+// equal, the key. The comparison compiles to a conditional move
+// instead of a branch.
+static int
+bound_loc (const uint64_t* keys, int n, uint64_t key, bool equal)
+{
+  if (n == 0)
+    return 0;
 
-search_surrounding:
-  if (surrounding)
-    return unit->get (surrounding)->jump (unit, loc, expanded_id, begin);
-  else
-    return NULL;
+  const uint64_t* base = keys;
+  while (n > 1)
+    {
+      int half = n / 2;
+      base = base[half] < key + ! equal ? base + half : base;
+      n -= half;
+    }
+  return base - keys + (*base < key + ! equal);
 }
 
-const std::set<jump_to>*
-context::jump_back (const file_location& loc, int expanded_id) const
+int
+jump_keys::find (const file_location& loc, int expanded_id) const
 {
-  jump_from from (loc, 0, expanded_id);
-  std::map<jump_from, std::set<jump_to> >::const_iterator it;
-  it = backs.upper_bound (from);
-  if (it == backs.begin ())
-    return NULL;
+  uint64_t key = pack (loc);
+  if (expanded_id == 0)
+    {
+      int i = bound_loc (locs.data (), plain, key, false) - 1;
+      if (i < 0)
+	return -1;
+      file_location from = this->loc (i);
+      if (from.line != loc.line
+	  || (from.col && from.col + lens[i] <= loc.col))
+	return -1;
+      return i;
+    }
+
+  int i = plain + bound_loc (locs.data () + plain, size () - plain,
+			     key, true);
+  for (; i < size () && locs[i] == key; ++ i)
+    if (expanded_ids[i] == expanded_id)
+      return i;
+  return -1;
+}
+
+// The key covering the location in the building map, end if none
+template <typename value>
+static typename std::map<jump_from, value>::const_iterator
+find_key (const std::map<jump_from, value>& keys,
+	  const file_location& loc, int expanded_id)
+{
+  typename std::map<jump_from, value>::const_iterator it;
+  it = keys.upper_bound (jump_from (loc, 0, expanded_id));
+  if (it == keys.begin ())
+    return keys.end ();
   -- it;
 
   if (expanded_id != 0
       && (it->first.loc != loc || it->first.expanded_id != expanded_id))
-    return NULL;
+    return keys.end ();
+
+  if (expanded_id == 0
+      && (it->first.expanded_id != 0
+	  || it->first.loc.line != loc.line
+	  || (it->first.loc.col
+	      && it->first.loc.col + it->first.len <= loc.col)))
+    return keys.end ();
+
+  return it;
+}
 
-  if (expanded_id == 0 && it->first.expanded_id != 0)
+const jump_to*
+context::find (const file_location& loc, int expanded_id,
+	       file_location* from) const
+{
+  if (frozen)
     {
-      it = backs.upper_bound (jump_from (it->first.loc, 0, 0));
-      if (it == backs.begin ())
+      const jump_table* tab = table (&frozen_jumps, false);
+      int i = tab->keys.find (loc, expanded_id);
+      if (i < 0)
 	return NULL;
-      -- it;
+      *from = tab->keys.loc (i);
+      return &tab->tos[i];
     }
 
-  if (expanded_id == 0
-      && (it->first.loc.line != loc.line
-	  || (it->first.loc.col
-	      && it->first.loc.col + it->first.len <= loc.col)))
+  std::map<jump_from, jump_to>::const_iterator it;
+  it = find_key (jumps, loc, expanded_id);
+  if (it == jumps.end ())
     return NULL;
-
+  *from = it->first.loc;
   return &it->second;
 }
 
+// Search the context, then its surrounding context, which is
+// resolved to outer when frozen
+const jump_to*
+context::jump (const unit* unit,
+	       const file_location& loc, int expanded_id,
+	       file_location* begin) const
+{
+  const context* ctx = this;
+  while (ctx)
+    {
+      file_location from;
+      const jump_to* to = ctx->find (loc, expanded_id, &from);
+      if (to)
+	{
+	  if (expanded_id == 0 && begin)
+	    *begin = from;
+	  return to;
+	}
+
+      if (ctx->frozen)
+	ctx = ctx->outer;
+      else
+	ctx = ctx->surrounding ? unit->get (ctx->surrounding) : NULL;
+    }
+  return NULL;
+}
+
+void
+context::resolve (const unit* unit)
+{
+  assert (frozen);
+  outer = surrounding ? unit->get (surrounding) : NULL;
+  std::vector<context>::iterator it;
+  for (it = expansion_list.begin (); it != expansion_list.end (); ++ it)
+    it->resolve (unit);
+}
+
+const jump_table*
+context::table (jump_table* tab, bool backs) const
+{
+  assert (frozen);
+  if (! tab->decoded)
+    tab->decode (backs);
+  return tab;
+}
+
+jump_backs
+context::jump_back (const file_location& loc, int expanded_id) const
+{
+  if (frozen)
+    {
+      const jump_table* tab = table (&frozen_backs, true);
+      int i = tab->keys.find (loc, expanded_id);
+      if (i < 0)
+	return jump_backs ();
+      return jump_backs (tab->tos.data () + tab->offsets[i],
+			 tab->tos.data () + tab->offsets[i + 1]);
+    }
+
+  std::map<jump_from, std::vector<jump_to> >::const_iterator it;
+  it = find_key (backs, loc, expanded_id);
+  if (it == backs.end ())
+    return jump_backs ();
+  return jump_backs (&it->second[0], &it->second[0] + it->second.size ());
+}
+
 static void
 print_jump_from (FILE* fp, const jump_from& from)
 {
@@ -283,6 +545,8 @@ print_jump_to (FILE* fp, const jump_to& to)
 void
 context::dump (FILE* fp, int indet, const unit* unit) const
 {
+  assert (! frozen);
+
   iprintf (fp, indet, "jumps:\n");
   std::map<jump_from, jump_to>::const_iterator jmp;
   for (jmp = jumps.begin (); jmp != jumps.end (); ++ jmp)
@@ -313,14 +577,14 @@ context::dump (FILE* fp, int indet, const unit* unit) const
     }
 
   iprintf (fp, indet, "backs:\n");
-  std::map<jump_from, std::set<jump_to> >::const_iterator bak;
+  std::map<jump_from, std::vector<jump_to> >::const_iterator bak;
   for (bak = backs.begin (); bak != backs.end (); ++ bak)
     {
       iprintf (fp, indet + 1, "");
       print_jump_from (fp, bak->first);
       fprintf (fp, "\n");
 
-      std::set<jump_to>::const_iterator bt;
+      std::vector<jump_to>::const_iterator bt;
       for (bt = bak->second.begin (); bt != bak->second.end(); ++ bt)
 	{
 	  iprintf (fp, indet + 2, "");
@@ -342,135 +606,56 @@ context::dump (FILE* fp, int indet, const unit* unit) const
 }
 
 static void
-save_jump_from (FILE* fp, const jump_from& from)
+save_jump_from (section_writer* sec, const jump_from& from)
 {
-  save_file_location (fp, from.loc);
-  save_int32 (fp, from.len);
-  save_int32 (fp, from.expanded_id);
+  save_file_location (sec, from.loc);
+  save_int32 (sec, from.len);
+  save_int32 (sec, from.expanded_id);
 }
 
 static void
-load_jump_from (FILE* fp, jump_from* from)
+load_jump_from (section_reader* sec, jump_from* from)
 {
-  load_file_location (fp, &from->loc);
-  load_int32 (fp, &from->len);
-  load_int32 (fp, &from->expanded_id);
+  load_file_location (sec, &from->loc);
+  load_int32 (sec, &from->len);
+  load_int32 (sec, &from->expanded_id);
 }
 
 static void
-save_jump_to (FILE* fp, const jump_to& to)
+save_jump_to (section_writer* sec, const jump_to& to)
 {
-  save_int32 (fp, to.unit);
-  save_int32 (fp, to.include);
-  save_int32 (fp, to.point);
-  save_file_location (fp, to.loc);
-  save_int32 (fp, to.expanded_id);
-  save_int32 (fp, to.exp);
+  save_int32 (sec, to.unit);
+  save_int32 (sec, to.include);
+  save_int32 (sec, to.point);
+  save_file_location (sec, to.loc);
+  save_int32 (sec, to.expanded_id);
+  save_int32 (sec, to.exp);
 }
 
 static void
-load_jump_to (FILE* fp, jump_to* to)
-{
-  load_int32 (fp, &to->unit);
-  load_int32 (fp, &to->include);
-  load_int32 (fp, &to->point);
-  load_file_location (fp, &to->loc);
-  load_int32 (fp, &to->expanded_id);
-  load_int32 (fp, &to->exp);
-}
-
-void
-context::save (FILE* fp) const
-{
-  save_int32 (fp, jumps.size ());
-  std::map<jump_from, jump_to>::const_iterator jmp;
-  for (jmp = jumps.begin (); jmp != jumps.end (); ++ jmp)
-    {
-      save_jump_from (fp, jmp->first);
-      save_jump_to (fp, jmp->second);
-    }
-
-  save_int32 (fp, backs.size ());
-  std::map<jump_from, std::set<jump_to> >::const_iterator bak;
-  for (bak = backs.begin (); bak != backs.end (); ++ bak)
-    {
-      save_jump_from (fp, bak->first);
-      save_int32 (fp, bak->second.size());
-      std::set<jump_to>::const_iterator bt;
-      for (bt = bak->second.begin (); bt != bak->second.end (); ++ bt)
-	save_jump_to (fp, *bt);
-    }
-
-  save_int32 (fp, surrounding);
-
-  save_int32 (fp, expansion_contexts.size ());
-  std::map<int, context>::const_iterator ctx;
-  for (ctx = expansion_contexts.begin ();
-       ctx != expansion_contexts.end ();
-       ++ ctx)
-    {
-      save_int32 (fp, ctx->first);
-      ctx->second.save (fp);
-    }
-}
-
-void
-context::load (FILE* fp)
+load_jump_to (section_reader* sec, jump_to* to)
 {
-  int jmp_size;
-  load_int32 (fp, &jmp_size);
-  for (int i = 0; i < jmp_size; ++ i)
-    {
-      jump_from from;
-      load_jump_from (fp, &from);
-
-      jump_to to;
-      load_jump_to (fp, &to);
-
-      jumps.insert (std::make_pair (from, to));
-    }
-
-  int bak_size;
-  load_int32 (fp, &bak_size);
-  for (int i = 0; i < bak_size; ++ i)
-    {
-      jump_from from;
-      load_jump_from (fp, &from);
-
-      int bt_size;
-      load_int32 (fp, &bt_size);
-      std::set<jump_to> tos;
-      for (int j = 0; j < bt_size; ++ j)
-	{
-	  jump_to to;
-	  load_jump_to (fp, &to);
-	  tos.insert(to);
-	}
-
-      backs.insert (std::make_pair (from , tos));
-    }
-
-  load_int32 (fp, &surrounding);
-
-  int ctx_size;
-  load_int32 (fp, &ctx_size);
-  for (int i = 0; i < ctx_size; ++ i)
-    {
-      int id;
-      load_int32 (fp, &id);
-      expansion_contexts.insert (std::make_pair (id, context ()));
-      expansion_contexts.find (id)->second.load (fp);
-    }
+  load_int32 (sec, &to->unit);
+  load_int32 (sec, &to->include);
+  load_int32 (sec, &to->point);
+  load_file_location (sec, &to->loc);
+  load_int32 (sec, &to->expanded_id);
+  load_int32 (sec, &to->exp);
 }
 
 int
 unit::file_id (const char* file)
 {
-  char* full = realpath (file, NULL);
-  if (! full)
-    return file_map.get (file);
-  int id = file_map.get (full);
-  free (full);
+  std::map<const char*, int>::iterator it = file_ptrs.find (file);
+  if (it != file_ptrs.end ())
+    return it->second;
+
+  // Only the units of set::next add files, with the paths of the set
+  assert (paths);
+  const std::string& full = paths->get (file);
+  int id = file_map.get (full.empty () ? std::string (file) : full);
+
+  file_ptrs.insert (std::make_pair (file, id));
   return id;
 }
 
@@ -479,15 +664,15 @@ unit::include_id (const source_stack& include)
 {
   int id = include_map.get (include);
 
-  assert (include.locs.size ());
-  int fid = include.locs.front ().fid;
+  assert (include.fid);
+  int fid = include.fid;
   if (file_includes.find (fid) == file_includes.end ())
     file_includes.insert (std::make_pair (fid, std::set<int> ()));
   file_includes.find (fid)->second.insert (id);
 
   if (input_id == 0
-      && include.locs.size () == 1
-      && include.locs.front ().fid == file_id (input.c_str ()))
+      && include.parent == 0
+      && include.fid == file_id (input.c_str ()))
     input_id = id;
 
   return id;
@@ -531,14 +716,13 @@ unit::dump (FILE* fp, int indet) const
 {
   for (int i = 1; i <= include_map.size (); ++ i)
     {
-      iprintf (fp, indet, "include %d:\n", i);
-      std::vector<source_location>::const_iterator loc;
-      for (loc = include_map.at (i).locs.begin ();
-	   loc != include_map.at (i).locs.end ();
-	   ++ loc)
+      const source_stack* inc = &include_map.at (i);
+      iprintf (fp, indet, "include %d: %s\n", i,
+	       file_map.at (inc->fid).c_str ());
+      for (; inc->parent; inc = &include_map.at (inc->parent))
 	iprintf (fp, indet + 1, "from %s:%d,%d\n",
-		 file_map.at (loc->fid).c_str (),
-		 loc->loc.line, loc->loc.col);
+		 file_map.at (include_map.at (inc->parent).fid).c_str (),
+		 inc->loc.line, inc->loc.col);
     }
 
   std::map<int, context>::const_iterator ctx;
@@ -575,7 +759,7 @@ unit::dump (FILE* fp, int indet) const
     }
 }
 static void
-save_srcs (FILE* fp,
+save_srcs (section_writer* fp,
 	   const std::map<std::string, std::vector<jump_src> >& srcs)
 {
   save_int32 (fp, srcs.size ());
@@ -594,7 +778,7 @@ save_srcs (FILE* fp,
 }
 
 static void
-load_srcs (FILE* fp,
+load_srcs (section_reader* fp,
 	   std::map<std::string, std::vector<jump_src> >* srcs)
 {
   int map_size;
@@ -619,7 +803,7 @@ load_srcs (FILE* fp,
 }
 
 static void
-save_tgts (FILE* fp, const std::map<std::string, jump_tgt>& tgts)
+save_tgts (section_writer* fp, const std::map<std::string, jump_tgt>& tgts)
 {
   save_int32 (fp, tgts.size ());
   std::map<std::string, jump_tgt>::const_iterator it;
@@ -633,7 +817,7 @@ save_tgts (FILE* fp, const std::map<std::string, jump_tgt>& tgts)
 }
 
 static void
-load_tgts (FILE* fp, std::map<std::string, jump_tgt>* tgts)
+load_tgts (section_reader* fp, std::map<std::string, jump_tgt>* tgts)
 {
   int map_size;
   load_int32 (fp, &map_size);
@@ -654,541 +838,3144 @@ load_tgts (FILE* fp, std::map<std::string, jump_tgt>* tgts)
     }
 }
 
+// A compressed file is a header, the offsets of the blocks and
+// the blocks:
+//   "GCJZ" version level block_size size { offset } ... end
+// Each block is compressed alone by lz_compress, or stored as is
+// if that doesn't make it smaller.
+static const char compressed_magic[4] = { 'G', 'C', 'J', 'Z' };
+static const int compressed_version = 1;
+static const int compressed_block_size = 64 * 1024;
+
+// A unit file is a header, a table of the sections and the
+// sections, each aligned to 8 bytes, so the file is read in place
+// once mapped:
+//   "GCJU" version section_count 0 { offset size } ...
+// Strings are offsets into the string pool. The jumps and backs of
+// each context are encoded in columns, see encode_table. Backs are
+// only used to refer and link, they are kept apart from the jumps
+// and decoded by jump_back alone.
+enum unit_section
+{
+  US_META,
+  US_STRINGS,
+  US_CONTEXTS,
+  US_JUMPS,
+  US_BACKS,
+  // The offsets of each expansion in the expansion data
+  US_EXPANSIONS,
+  US_EXPANSION_DATA,
+  US_FILES,
+  US_INCLUDES,
+  US_POINTS,
+  US_FILE_INCLUDES,
+  US_PUBS,
+  US_COUNT
+};
+
+static const char unit_magic[4] = { 'G', 'C', 'J', 'U' };
+static const int unit_version = 2;
+
+// A context in a unit file, include contexts have point 0 and are
+// followed by their expansion contexts. The jumps and backs are
+// the offsets and sizes of their tables.
+struct context_entry
+{
+  int32_t include;
+  int32_t point;
+  int32_t surrounding;
+  int32_t jumps;
+  int32_t jump_size;
+  int32_t backs;
+  int32_t back_size;
+};
+
+struct unit_sections
+{
+  unit_sections ()
+  {
+    for (int i = 0; i < US_COUNT; ++ i)
+      secs[i].pool = &pool;
+  }
+
+  section_writer secs[US_COUNT];
+  string_pool pool;
+};
+
 static void
-save_int32r (FILE* fp, const int& v)
+save_varint (std::string* out, uint32_t v)
 {
-  save_int32 (fp, v);
+  for (; v >= 0x80; v >>= 7)
+    *out += (char) (v | 0x80);
+  *out += (char) v;
 }
 
-void
-unit::save (const std::string& path) const
+static void
+save_zigzag (std::string* out, int v)
 {
-  FILE* fp = fopen (path.c_str (), "wb");
-  assert (fp);
-
-  save_string (fp, input);
-  save_int32 (fp, input_id);
+  save_varint (out, (uint32_t) v << 1 ^ (uint32_t) (v >> 31));
+}
 
-  save_int32 (fp, contexts.size ());
-  std::map<int, context>::const_iterator ctx;
-  for (ctx = contexts.begin (); ctx != contexts.end (); ++ ctx)
+static inline uint32_t
+load_varint (const unsigned char** p, const unsigned char* end)
+{
+  uint32_t v = 0;
+  for (int shift = 0; ; shift += 7)
     {
-      save_int32 (fp, ctx->first);
-      ctx->second.save (fp);
+      assert (*p < end);
+      unsigned char b = *(*p) ++;
+      v |= (uint32_t) (b & 0x7f) << shift;
+      if (! (b & 0x80))
+	return v;
     }
+}
 
-  save_int32 (fp, expansions.size ());
-  std::map<int, expansion>::const_iterator exp;
-  for (exp = expansions.begin (); exp != expansions.end (); ++ exp)
-    {
-      exp->second.map.save (fp, save_int32r);
+static inline int
+load_zigzag (const unsigned char** p, const unsigned char* end)
+{
+  uint32_t v = load_varint (p, end);
+  return (int) (v >> 1) ^ - (int) (v & 1);
+}
 
-      save_int32 (fp, exp->second.tokens.size ());
-      std::vector<expanded_token>::const_iterator tok;
-      for (tok = exp->second.tokens.begin ();
-	   tok != exp->second.tokens.end ();
-	   ++ tok)
-	{
-	  save_string (fp, tok->token);
-	  save_int32 (fp, tok->id);
-	}
+// The keys are sorted, so lines and the columns in the same line
+// are coded as deltas. The targets mostly share few units,
+// includes and points, which are coded as indexes into the
+// distinct ones. Each column is stored in a row:
+//   count plain
+//   lines, columns, lens, expanded ids of the keys not plain, and
+//   the number of the targets of each key for backs
+//   the distinct units, includes and points of the targets
+//   indexes to them, lines, columns, expanded ids and exps of the
+//   targets
+static void
+encode_table (std::string* out, const std::vector<jump_from>& keys,
+	      const std::vector<int>* counts,
+	      const std::vector<jump_to>& tos)
+{
+  int plain = 0;
+  while (plain < (int) keys.size () && ! keys[plain].expanded_id)
+    ++ plain;
+
+  save_varint (out, keys.size ());
+  save_varint (out, plain);
+
+  for (size_t i = 0; i < keys.size (); ++ i)
+    save_zigzag (out, keys[i].loc.line - (i ? keys[i - 1].loc.line : 0));
+  for (size_t i = 0; i < keys.size (); ++ i)
+    save_zigzag (out, keys[i].loc.col
+		      - (i && keys[i - 1].loc.line == keys[i].loc.line
+			 ? keys[i - 1].loc.col : 0));
+  for (size_t i = 0; i < keys.size (); ++ i)
+    save_zigzag (out, keys[i].len);
+  for (size_t i = plain; i < keys.size (); ++ i)
+    save_zigzag (out, keys[i].expanded_id);
+  if (counts)
+    for (size_t i = 0; i < keys.size (); ++ i)
+      save_varint (out, (*counts)[i]);
+
+  typedef std::pair<int, std::pair<int, int> > target;
+  std::map<target, int> targets;
+  std::vector<int> indexes;
+  std::vector<jump_to>::const_iterator to;
+  for (to = tos.begin (); to != tos.end (); ++ to)
+    {
+      target t (to->unit, std::make_pair (to->include, to->point));
+      indexes.push_back (targets.insert (std::make_pair (t,
+							 targets.size ()))
+			 .first->second);
     }
 
-  file_map.save (fp, save_string);
-  include_map.save (fp, save_source_stack);
-  point_map.save (fp, save_expansion_point);
-
-  save_int32 (fp, file_includes.size ());
-  std::map<int, std::set<int> >::const_iterator fil;
-  for (fil = file_includes.begin ();
-       fil != file_includes.end ();
-       ++ fil)
+  std::vector<target> order (targets.size ());
+  std::map<target, int>::const_iterator it;
+  for (it = targets.begin (); it != targets.end (); ++ it)
+    order[it->second] = it->first;
+  save_varint (out, order.size ());
+  for (size_t i = 0; i < order.size (); ++ i)
     {
-      save_int32 (fp, fil->first);
-      save_int32 (fp, fil->second.size ());
-      std::set<int>::const_iterator inc;
-      for (inc = fil->second.begin ();
-	   inc != fil->second.end ();
-	   ++ inc)
-	save_int32 (fp, *inc);
+      save_zigzag (out, order[i].first);
+      save_zigzag (out, order[i].second.first);
+      save_zigzag (out, order[i].second.second);
     }
 
-  save_srcs (fp, pub_srcs);
-  save_tgts (fp, pub_tgts);
-
-  fclose (fp);
+  for (size_t i = 0; i < tos.size (); ++ i)
+    save_varint (out, indexes[i]);
+  for (size_t i = 0; i < tos.size (); ++ i)
+    save_zigzag (out, tos[i].loc.line - (i ? tos[i - 1].loc.line : 0));
+  for (size_t i = 0; i < tos.size (); ++ i)
+    save_zigzag (out, tos[i].loc.col);
+  for (size_t i = 0; i < tos.size (); ++ i)
+    save_zigzag (out, tos[i].expanded_id);
+  for (size_t i = 0; i < tos.size (); ++ i)
+    save_zigzag (out, tos[i].exp);
 }
 
 void
-unit::load (const std::string& path)
+jump_table::decode (bool backs)
 {
-  FILE* fp = fopen (path.c_str (), "rb");
-  assert (fp);
-
-  load_string (fp, &input);
-  load_int32 (fp, &input_id);
+  const unsigned char* p;
+  p = (const unsigned char*) file->bytes (section, offset, size);
+  const unsigned char* end = p + size;
+  int count = load_varint (&p, end);
+  keys.plain = load_varint (&p, end);
+  assert (keys.plain <= count);
+
+  keys.locs.resize (count);
+  keys.lens.resize (count);
+  keys.expanded_ids.assign (count, 0);
+
+  std::vector<int> lines (count);
+  int line = 0;
+  for (int i = 0; i < count; ++ i)
+    lines[i] = line += load_zigzag (&p, end);
+  for (int i = 0; i < count; ++ i)
+    {
+      int col = load_zigzag (&p, end);
+      if (i && lines[i - 1] == lines[i])
+	col += (uint32_t) keys.locs[i - 1];
+      keys.locs[i] = jump_keys::pack (file_location (lines[i], col));
+    }
+  for (int i = 0; i < count; ++ i)
+    keys.lens[i] = load_zigzag (&p, end);
+  for (int i = keys.plain; i < count; ++ i)
+    keys.expanded_ids[i] = load_zigzag (&p, end);
 
-  int ctx_size;
-  load_int32 (fp, &ctx_size);
-  for (int i = 0; i < ctx_size; ++ i)
+  int to_count = count;
+  if (backs)
     {
-      int id;
-      load_int32 (fp, &id);
-      contexts.insert (std::make_pair (id, context ()));
-      contexts.find (id)->second.load (fp);
+      offsets.resize (count + 1);
+      offsets[0] = 0;
+      for (int i = 0; i < count; ++ i)
+	offsets[i + 1] = offsets[i] + load_varint (&p, end);
+      to_count = offsets[count];
     }
 
-  int expansion_size;
-  load_int32 (fp, &expansion_size);
-  for (int i = 0; i < expansion_size; ++ i)
+  std::vector<jump_to> targets (load_varint (&p, end));
+  for (size_t i = 0; i < targets.size (); ++ i)
     {
-      expansion* exp = get_expansion (get_expansion ());
-      exp->map.load (fp, load_int32);
+      targets[i].unit = load_zigzag (&p, end);
+      targets[i].include = load_zigzag (&p, end);
+      targets[i].point = load_zigzag (&p, end);
+    }
 
-      int tok_size;
-      load_int32 (fp, &tok_size);
-      for (int j = 0; j < tok_size; ++ j)
-	{
-	  expanded_token tok;
-	  load_string (fp, &tok.token);
-	  load_int32 (fp, &tok.id);
-	  exp->tokens.push_back (tok);
-	}
+  tos.resize (to_count);
+  for (int i = 0; i < to_count; ++ i)
+    {
+      uint32_t index = load_varint (&p, end);
+      assert (index < targets.size ());
+      tos[i] = targets[index];
     }
+  line = 0;
+  for (int i = 0; i < to_count; ++ i)
+    tos[i].loc.line = line += load_zigzag (&p, end);
+  for (int i = 0; i < to_count; ++ i)
+    tos[i].loc.col = load_zigzag (&p, end);
+  for (int i = 0; i < to_count; ++ i)
+    tos[i].expanded_id = load_zigzag (&p, end);
+  for (int i = 0; i < to_count; ++ i)
+    tos[i].exp = load_zigzag (&p, end);
+
+  assert (p == end);
+  decoded = true;
+}
 
-  file_map.load (fp, load_string);
-  include_map.load (fp, load_source_stack);
-  point_map.load (fp, load_expansion_point);
+static void
+save_context (unit_sections* us, int include, int point,
+	      const context& ctx)
+{
+  assert (! ctx.frozen);
+  section_writer* secs = us->secs;
 
-  int fil_size;
-  load_int32 (fp, &fil_size);
-  for (int i = 0; i < fil_size; ++ i)
+  context_entry ent;
+  ent.include = include;
+  ent.point = point;
+  ent.surrounding = ctx.surrounding;
+
+  std::vector<jump_from> keys;
+  std::vector<jump_to> tos;
+  std::map<jump_from, jump_to>::const_iterator jmp;
+  for (jmp = ctx.jumps.begin (); jmp != ctx.jumps.end (); ++ jmp)
     {
-      int fid;
-      load_int32 (fp, &fid);
-      int inc_size;
-      load_int32 (fp, &inc_size);
-      std::set<int> includes;
-      for (int j = 0; j < inc_size; ++ j)
-	{
-	  int inc_id;
-	  load_int32 (fp, &inc_id);
-	  includes.insert (inc_id);
-	}
-      file_includes.insert (std::make_pair (fid, includes));
+      keys.push_back (jmp->first);
+      tos.push_back (jmp->second);
     }
+  ent.jumps = secs[US_JUMPS].data.size ();
+  encode_table (&secs[US_JUMPS].data, keys, NULL, tos);
+  ent.jump_size = secs[US_JUMPS].data.size () - ent.jumps;
+
+  keys.clear ();
+  tos.clear ();
+  std::vector<int> counts;
+  std::map<jump_from, std::vector<jump_to> >::const_iterator bak;
+  for (bak = ctx.backs.begin (); bak != ctx.backs.end (); ++ bak)
+    {
+      keys.push_back (bak->first);
+      counts.push_back (bak->second.size ());
+      tos.insert (tos.end (), bak->second.begin (), bak->second.end ());
+    }
+  ent.backs = secs[US_BACKS].data.size ();
+  encode_table (&secs[US_BACKS].data, keys, &counts, tos);
+  ent.back_size = secs[US_BACKS].data.size () - ent.backs;
 
-  load_srcs (fp, &pub_srcs);
-  load_tgts (fp, &pub_tgts);
-
-  fclose (fp);
+  save_raw (&secs[US_CONTEXTS], &ent, sizeof ent);
 }
 
-static std::string
-index_path (const std::string& db)
+static void
+save_expansion (section_writer* sec, const expansion& exp)
 {
-  return joinpath (db.c_str (), "index", NULL);
-}
+  exp.map.save (sec, save_int32r);
 
-static std::string
-unit_path (const std::string& db, int id)
-{
-  return joinpath (db.c_str(), "units", tostr (id).c_str (), NULL);
+  save_int32 (sec, exp.tokens.size ());
+  std::vector<expanded_token>::const_iterator tok;
+  for (tok = exp.tokens.begin (); tok != exp.tokens.end (); ++ tok)
+    {
+      save_string (sec, tok->token);
+      save_int32 (sec, tok->id);
+    }
 }
 
-static std::string
-unit_path (const std::string& db, int ld, int id)
+static void
+load_expansion (section_reader* sec, expansion* exp)
 {
-  return joinpath (db.c_str(), "units",
-		   (tostr (ld) + '.' + tostr (id)).c_str (), NULL);
-}
+  exp->map.load (sec, load_int32);
 
-static std::string
-files_path (const std::string& db, int ld)
-{
-  return joinpath (db.c_str(), "files", tostr (ld).c_str (), NULL);
+  int tok_size;
+  load_int32 (sec, &tok_size);
+  exp->tokens.resize (tok_size);
+  for (int i = 0; i < tok_size; ++ i)
+    {
+      load_string (sec, &exp->tokens[i].token);
+      load_int32 (sec, &exp->tokens[i].id);
+    }
 }
 
 void
-set_data::save (const std::string& path) const
+unit::save (std::string* out, int level) const
 {
-  FILE* fp = fopen (path.c_str (), "wb");
+  unit_sections us;
+  section_writer* secs = us.secs;
+
+  save_string (&secs[US_META], input);
+  save_int32 (&secs[US_META], input_id);
+
+  std::map<int, context>::const_iterator ctx;
+  for (ctx = contexts.begin (); ctx != contexts.end (); ++ ctx)
+    {
+      save_context (&us, ctx->first, 0, ctx->second);
+      std::map<int, context>::const_iterator exp;
+      for (exp = ctx->second.expansion_contexts.begin ();
+	   exp != ctx->second.expansion_contexts.end ();
+	   ++ exp)
+	save_context (&us, ctx->first, exp->first, exp->second);
+    }
+
+  std::map<int, expansion>::const_iterator exp;
+  for (exp = expansions.begin (); exp != expansions.end (); ++ exp)
+    {
+      save_int32 (&secs[US_EXPANSIONS], secs[US_EXPANSION_DATA].data.size ());
+      save_expansion (&secs[US_EXPANSION_DATA], exp->second);
+    }
+  save_int32 (&secs[US_EXPANSIONS], secs[US_EXPANSION_DATA].data.size ());
+
+  file_map.save (&secs[US_FILES], save_string);
+  include_map.save (&secs[US_INCLUDES], save_source_stack);
+  point_map.save (&secs[US_POINTS], save_expansion_point);
+
+  section_writer* sec = &secs[US_FILE_INCLUDES];
+  save_int32 (sec, file_includes.size ());
+  std::map<int, std::set<int> >::const_iterator fil;
+  for (fil = file_includes.begin ();
+       fil != file_includes.end ();
+       ++ fil)
+    {
+      save_int32 (sec, fil->first);
+      save_int32 (sec, fil->second.size ());
+      std::set<int>::const_iterator inc;
+      for (inc = fil->second.begin ();
+	   inc != fil->second.end ();
+	   ++ inc)
+	save_int32 (sec, *inc);
+    }
+
+  save_srcs (&secs[US_PUBS], pub_srcs);
+  save_tgts (&secs[US_PUBS], pub_tgts);
+
+  secs[US_STRINGS].data = us.pool.data;
+
+  int32_t header[4] = { 0, unit_version, US_COUNT, 0 };
+  memcpy (header, unit_magic, sizeof unit_magic);
+  uint64_t table[US_COUNT * 2];
+  uint64_t offset = sizeof header + sizeof table;
+  for (int i = 0; i < US_COUNT; ++ i)
+    {
+      // Compressed backs have blocks of their own, so jumps and
+      // expansions never inflate them
+      if (level && (i == US_BACKS || i == US_BACKS + 1))
+	offset = (offset + compressed_block_size - 1)
+		 / compressed_block_size * compressed_block_size;
+      table[i * 2] = offset;
+      table[i * 2 + 1] = secs[i].data.size ();
+      offset = (offset + secs[i].data.size () + 7) & ~(uint64_t) 7;
+    }
+
+  std::string file ((const char*) header, sizeof header);
+  file.append ((const char*) table, sizeof table);
+  for (int i = 0; i < US_COUNT; ++ i)
+    {
+      file.resize (table[i * 2]);
+      file += secs[i].data;
+    }
+  file.resize (offset);
+  encode_file (out, file, level);
+}
+
+static const int lz_min_match = 4;
+static const int lz_hash_bits = 14;
+
+static uint32_t
+lz_hash (const char* p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof v);
+  return (v * 2654435761u) >> (32 - lz_hash_bits);
+}
+
+// LZ77 with hash chains, the level is how many earlier positions
+// with the same hash are tried, the output is sequences of
+//   literal_length literals match_offset match_length-4
+// in varints, ending with the last literals
+static void
+lz_compress (std::string* out, const char* in, int size, int level)
+{
+  std::vector<int> head (1 << lz_hash_bits, -1);
+  std::vector<int> prev (size);
+  int attempts = 1 << (level - 1);
+
+  int lit = 0;
+  int i = 0;
+  while (i + lz_min_match <= size)
+    {
+      uint32_t h = lz_hash (in + i);
+      int best_len = 0;
+      int best_off = 0;
+      int cand = head[h];
+      for (int n = 0; cand >= 0 && n < attempts; ++ n, cand = prev[cand])
+	{
+	  int len = 0;
+	  while (i + len < size && in[cand + len] == in[i + len])
+	    ++ len;
+	  if (len > best_len)
+	    {
+	      best_len = len;
+	      best_off = i - cand;
+	    }
+	}
+      prev[i] = head[h];
+      head[h] = i;
+
+      if (best_len < lz_min_match)
+	{
+	  ++ i;
+	  continue;
+	}
+
+      save_varint (out, i - lit);
+      out->append (in + lit, i - lit);
+      save_varint (out, best_off);
+      save_varint (out, best_len - lz_min_match);
+
+      for (int j = i + 1; j < i + best_len && j + lz_min_match <= size; ++ j)
+	{
+	  h = lz_hash (in + j);
+	  prev[j] = head[h];
+	  head[h] = j;
+	}
+      i += best_len;
+      lit = i;
+    }
+
+  save_varint (out, size - lit);
+  out->append (in + lit, size - lit);
+}
+
+static void
+lz_decompress (char* out, int size, const unsigned char* in,
+	       const unsigned char* end)
+{
+  int o = 0;
+  while (true)
+    {
+      uint32_t lit = load_varint (&in, end);
+      assert (lit <= (uint32_t) (size - o) && lit <= (uint32_t) (end - in));
+      memcpy (out + o, in, lit);
+      in += lit;
+      o += lit;
+      if (o == size)
+	break;
+
+      uint32_t off = load_varint (&in, end);
+      uint32_t len = load_varint (&in, end) + lz_min_match;
+      assert (off > 0 && off <= (uint32_t) o
+	      && len <= (uint32_t) (size - o));
+      // The match may overlap what it copies
+      for (const char* p = out + o - off; len; -- len)
+	out[o ++] = *p ++;
+    }
+  assert (in == end);
+}
+
+void
+encode_file (std::string* out, const std::string& data, int level)
+{
+  if (level == 0)
+    {
+      *out += data;
+      return;
+    }
+
+  assert (level > 0 && level <= 9);
+  int32_t header[4] = { 0, compressed_version, level,
+			compressed_block_size };
+  memcpy (header, compressed_magic, sizeof compressed_magic);
+  uint64_t size = data.size ();
+  size_t count = (size + compressed_block_size - 1) / compressed_block_size;
+
+  std::vector<uint64_t> offsets;
+  uint64_t offset = sizeof header + sizeof size
+		    + (count + 1) * sizeof (uint64_t);
+  std::string blocks;
+  for (size_t i = 0; i < count; ++ i)
+    {
+      offsets.push_back (offset + blocks.size ());
+      const char* block = data.c_str () + i * compressed_block_size;
+      int block_size = std::min ((uint64_t) compressed_block_size,
+				 size - i * compressed_block_size);
+      std::string code;
+      lz_compress (&code, block, block_size, level);
+      if (code.size () < (size_t) block_size)
+	blocks += code;
+      else
+	blocks.append (block, block_size);
+    }
+  offsets.push_back (offset + blocks.size ());
+
+  out->append ((const char*) header, sizeof header);
+  out->append ((const char*) &size, sizeof size);
+  out->append ((const char*) &offsets[0], offsets.size () * sizeof (uint64_t));
+  *out += blocks;
+}
+
+mapped_file::~mapped_file ()
+{
+  if (map)
+    munmap (map, map_size);
+  if (raw)
+    munmap (raw, size);
+}
+
+void
+mapped_file::load (int pack, const pack_entry& ent)
+{
+  // The mapping starts at the page of the entry
+  uint64_t base = ent.offset & ~(uint64_t) (sysconf (_SC_PAGESIZE) - 1);
+  map_size = ent.offset - base + ent.size;
+  size = ent.size;
+  assert (size > 0);
+  map = mmap (NULL, map_size, PROT_READ, MAP_PRIVATE, pack, base);
+  assert (map != MAP_FAILED);
+  begin = (const char*) map + (ent.offset - base);
+
+  const char* p = begin;
+  int32_t header[4];
+  if (ent.size < sizeof header
+      || memcmp (p, compressed_magic, sizeof compressed_magic) != 0)
+    return;
+
+  memcpy (header, p, sizeof header);
+  assert (header[1] == compressed_version);
+  level = header[2];
+  block_size = header[3];
+  assert (ent.size >= sizeof header + sizeof size);
+  memcpy (&size, p + sizeof header, sizeof size);
+
+  size_t count = (size + block_size - 1) / block_size;
+  const char* table = p + sizeof header + sizeof size;
+  assert (table + (count + 1) * sizeof (uint64_t) <= p + ent.size);
+  blocks.resize (count + 1);
+  memcpy (&blocks[0], table, blocks.size () * sizeof (uint64_t));
+  assert (blocks[count] <= ent.size);
+  inflated.assign (count, false);
+
+  // Pages are only committed for the blocks decompressed
+  if (size)
+    {
+      raw = (char*) mmap (NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      assert (raw != MAP_FAILED);
+    }
+}
+
+const char*
+mapped_file::bytes (uint64_t offset, uint64_t size) const
+{
+  assert (offset + size <= this->size);
+  if (! raw)
+    return begin + offset;
+
+  for (uint64_t i = offset / block_size;
+       size && i <= (offset + size - 1) / block_size;
+       ++ i)
+    if (! inflated[i])
+      {
+	const unsigned char* code = (const unsigned char*) begin + blocks[i];
+	uint64_t code_size = blocks[i + 1] - blocks[i];
+	uint64_t n = std::min (block_size, this->size - i * block_size);
+	if (code_size == n)
+	  memcpy (raw + i * block_size, code, n);
+	else
+	  lz_decompress (raw + i * block_size, n, code, code + code_size);
+	inflated[i] = true;
+      }
+  return raw + offset;
+}
+
+// Inflate only the blocks up to the end of the string
+const char*
+mapped_file::string (uint64_t offset) const
+{
+  uint64_t end = offset;
+  while (true)
+    {
+      // Up to the end of the block, or of the file if it isn't
+      // compressed
+      uint64_t n = size - end;
+      if (raw)
+	n = std::min (n, block_size - end % block_size);
+      assert (n);
+      if (memchr (bytes (end, n), 0, n))
+	return bytes (offset, end + n - offset);
+      end += n;
+    }
+}
+
+void
+unit_file::load (int pack, const pack_entry& ent)
+{
+  data.load (pack, ent);
+
+  int32_t header[4];
+  uint64_t table[US_COUNT * 2];
+  assert (data.size >= sizeof header + sizeof table);
+  memcpy (header, data.bytes (0, sizeof header), sizeof header);
+  assert (memcmp (header, unit_magic, sizeof unit_magic) == 0
+	  && header[1] == unit_version && header[2] == US_COUNT);
+  memcpy (table, data.bytes (sizeof header, sizeof table), sizeof table);
+  for (int i = 0; i < US_COUNT; ++ i)
+    {
+      assert (table[i * 2] % 8 == 0
+	      && table[i * 2] + table[i * 2 + 1] <= data.size);
+      sections.push_back (std::make_pair (table[i * 2], table[i * 2 + 1]));
+    }
+}
+
+const char*
+unit_file::bytes (int id, uint64_t offset, uint64_t size) const
+{
+  assert (offset + size <= sections[id].second);
+  return data.bytes (sections[id].first + offset, size);
+}
+
+section_reader
+unit_file::reader (int id) const
+{
+  return reader (id, 0, sections[id].second);
+}
+
+section_reader
+unit_file::reader (int id, uint64_t offset, uint64_t size) const
+{
+  const char* p = bytes (id, offset, size);
+  return section_reader (p, p + size, this);
+}
+
+const char*
+unit_file::string (int offset) const
+{
+  assert (offset >= 0 && (uint64_t) offset < sections[US_STRINGS].second);
+  return data.string (sections[US_STRINGS].first + offset);
+}
+
+static void
+map_table (jump_table* tab, const unit_file* file, int id,
+	   int offset, int size)
+{
+  tab->file = file;
+  tab->section = id;
+  tab->offset = offset;
+  tab->size = size;
+}
+
+// Refer to the tables of the context in the mapped file
+static void
+map_context (context* ctx, const unit_file* file,
+	     const context_entry& ent)
+{
+  ctx->frozen = true;
+  ctx->surrounding = ent.surrounding;
+  map_table (&ctx->frozen_jumps, file, US_JUMPS, ent.jumps, ent.jump_size);
+  map_table (&ctx->frozen_backs, file, US_BACKS, ent.backs, ent.back_size);
+}
+
+void
+unit::load (int pack, const pack_entry& ent)
+{
+  assert (! file);
+  file = new unit_file ();
+  file->load (pack, ent);
+
+  section_reader meta = file->reader (US_META);
+  load_string (&meta, &input);
+  load_int32 (&meta, &input_id);
+}
+
+static bool
+entry_before (const context_entry& ent, int include)
+{
+  return ent.include < include;
+}
+
+const context*
+unit::get (int include) const
+{
+  std::map<int, context>::const_iterator it = contexts.find (include);
+  if (it != contexts.end ())
+    return &it->second;
+  if (! file)
+    return NULL;
+
+  // Binary search the directory, the include context is followed
+  // by its expansion contexts
+  int n;
+  const context_entry* ents;
+  ents = file->section<context_entry> (US_CONTEXTS, &n);
+  const context_entry* ent = std::lower_bound (ents, ents + n, include,
+					       entry_before);
+  if (ent == ents + n || ent->include != include)
+    return NULL;
+  assert (ent->point == 0);
+
+  context* ctx = &contexts.insert (std::make_pair (include, context ()))
+		    .first->second;
+  map_context (ctx, file, *ent);
+
+  const context_entry* end = ent + 1;
+  while (end != ents + n && end->include == include)
+    ++ end;
+
+  ctx->expansion_ids.resize (end - ent - 1);
+  ctx->expansion_list.resize (end - ent - 1);
+  for (const context_entry* exp = ent + 1; exp != end; ++ exp)
+    {
+      ctx->expansion_ids[exp - ent - 1] = exp->point;
+      map_context (&ctx->expansion_list[exp - ent - 1], file, *exp);
+    }
+
+  ctx->resolve (this);
+  return ctx;
+}
+
+const std::string&
+unit::get_file (int fid) const
+{
+  if (file && ! file_map.contains (fid))
+    {
+      // The map is the size then the string of each id
+      std::string name;
+      section_reader sec = file->reader (US_FILES, fid * sizeof (int32_t),
+					 sizeof (int32_t));
+      load_string (&sec, &name);
+      file_map.set (fid, name);
+    }
+  return file_map.at (fid);
+}
+
+const source_stack&
+unit::get_include (int include) const
+{
+  if (file && ! include_map.contains (include))
+    {
+      // The map is the size then the stacks of 4 int32 each
+      source_stack stack;
+      uint64_t size = 4 * sizeof (int32_t);
+      section_reader sec = file->reader (US_INCLUDES,
+					 sizeof (int32_t)
+					 + (include - 1) * size,
+					 size);
+      load_source_stack (&sec, &stack);
+      include_map.set (include, stack);
+    }
+  return include_map.at (include);
+}
+
+bool
+unit::has_include (int include) const
+{
+  if (! file)
+    return include_map.contains (include);
+
+  int n;
+  section_reader sec = file->reader (US_INCLUDES, 0, sizeof (int32_t));
+  load_int32 (&sec, &n);
+  return include > 0 && include <= n;
+}
+
+const std::map<int, std::set<int> >&
+unit::get_file_includes () const
+{
+  if (! file || (tables & UT_FILE_INCLUDES))
+    return file_includes;
+  tables |= UT_FILE_INCLUDES;
+
+  section_reader sec = file->reader (US_FILE_INCLUDES);
+  int fil_size;
+  load_int32 (&sec, &fil_size);
+  for (int i = 0; i < fil_size; ++ i)
+    {
+      int fid;
+      load_int32 (&sec, &fid);
+      int inc_size;
+      load_int32 (&sec, &inc_size);
+      std::set<int> includes;
+      for (int j = 0; j < inc_size; ++ j)
+	{
+	  int inc_id;
+	  load_int32 (&sec, &inc_id);
+	  includes.insert (includes.end (), inc_id);
+	}
+      file_includes.insert (std::make_pair (fid, includes));
+    }
+  return file_includes;
+}
+
+static void
+load_pubs (const unit_file* file, int* tables,
+	   std::map<std::string, std::vector<jump_src> >* srcs,
+	   std::map<std::string, jump_tgt>* tgts)
+{
+  if (! file || (*tables & UT_PUBS))
+    return;
+  *tables |= UT_PUBS;
+
+  section_reader pubs = file->reader (US_PUBS);
+  load_srcs (&pubs, srcs);
+  load_tgts (&pubs, tgts);
+}
+
+const std::map<std::string, std::vector<jump_src> >&
+unit::get_pub_srcs () const
+{
+  load_pubs (file, &tables, &pub_srcs, &pub_tgts);
+  return pub_srcs;
+}
+
+const std::map<std::string, jump_tgt>&
+unit::get_pub_tgts () const
+{
+  load_pubs (file, &tables, &pub_srcs, &pub_tgts);
+  return pub_tgts;
+}
+
+const expansion*
+unit::get_expansion (int id) const
+{
+  std::map<int, expansion>::const_iterator it = expansions.find (id);
+  if (it != expansions.end ())
+    return &it->second;
+
+  int n;
+  assert (file && id > 0);
+  const int32_t* offsets = file->section<int32_t> (US_EXPANSIONS, &n);
+  assert (id < n);
+
+  section_reader sec = file->reader (US_EXPANSION_DATA, offsets[id - 1],
+				     offsets[id] - offsets[id - 1]);
+
+  expansion* exp = &expansions.insert (std::make_pair (id, expansion ()))
+		      .first->second;
+  load_expansion (&sec, exp);
+  return exp;
+}
+
+static std::string
+index_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "index", NULL);
+}
+
+static std::string
+journal_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "journal", NULL);
+}
+
+static std::string
+ids_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "ids", NULL);
+}
+
+static std::string
+keys_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "keys", NULL);
+}
+
+static std::string
+pack_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "pack", NULL);
+}
+
+enum journal_record
+{
+  // A unit is built, with its id, arguments and pack entry
+  JR_UNIT = 1
+};
+
+// Open and lock the journal. The journal is unlinked when folded
+// into the index, retry if we locked an unlinked one.
+static int
+lock_journal (const std::string& db, int op)
+{
+  std::string path = journal_path (db);
+  while (true)
+    {
+      int fd = open (path.c_str (), O_RDWR | O_CREAT | O_APPEND, 0644);
+      assert (fd != -1);
+      assert (flock (fd, op) == 0);
+
+      struct stat st;
+      assert (fstat (fd, &st) == 0);
+      if (st.st_nlink)
+	return fd;
+      close (fd);
+    }
+}
+
+static uint64_t
+hash_string (const std::string& str)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < str.size (); ++ i)
+    h = (h ^ (unsigned char) str[i]) * 1099511628211ULL;
+  return h;
+}
+
+// A record is its magic, size and the hash of its bytes before
+// them, so the complete records after a torn one left by a crashed
+// writer are still found
+static const int32_t record_magic = 0x6a636721;
+
+// Each record is written with a single write on an O_APPEND
+// descriptor, so concurrent appends never interleave
+static void
+append_record (int fd, void (* sv)(FILE*, const void*), const void* arg)
+{
+  char* buf;
+  size_t size;
+  FILE* mem = open_memstream (&buf, &size);
+  assert (mem);
+  int32_t head[3] = { record_magic, 0, 0 };
+  assert (fwrite (head, sizeof head, 1, mem) == 1);
+  sv (mem, arg);
+  assert (fclose (mem) == 0);
+  head[1] = size - sizeof head;
+  head[2] = (int32_t) hash_string (std::string (buf + sizeof head, head[1]));
+  memcpy (buf, head, sizeof head);
+
+  assert (write (fd, buf, size) == (ssize_t) size);
+  free (buf);
+}
+
+// The records appended to the file, false if there's none
+static bool
+read_records (const std::string& path, std::string* records)
+{
+  FILE* fp = fopen (path.c_str (), "rb");
+  if (! fp)
+    return false;
+  char chunk[65536];
+  size_t n;
+  while ((n = fread (chunk, 1, sizeof chunk, fp)) != 0)
+    records->append (chunk, n);
+  fclose (fp);
+  return true;
+}
+
+// Read the next record at pos, false at the end. A torn record is
+// skipped to the next one whose size and hash match.
+static bool
+read_record (const std::string& records, size_t* pos,
+	     std::vector<char>* buf)
+{
+  int32_t head[3];
+  for (; *pos + sizeof head <= records.size (); ++ *pos)
+    {
+      memcpy (head, &records[*pos], sizeof head);
+      size_t start = *pos + sizeof head;
+      if (head[0] != record_magic || head[1] < 0
+	  || (size_t) head[1] > records.size () - start
+	  || (int32_t) hash_string (records.substr (start, head[1]))
+	     != head[2])
+	continue;
+
+      buf->assign (records.begin () + start,
+		   records.begin () + start + head[1]);
+      buf->push_back ('\0');
+      *pos = start + head[1];
+      return true;
+    }
+  return false;
+}
+
+static void
+append_journal (const std::string& db,
+		void (* sv)(FILE*, const void*), const void* arg)
+{
+  int fd = lock_journal (db, LOCK_SH);
+  append_record (fd, sv, arg);
+  close (fd);
+}
+
+struct unit_record
+{
+  int id;
+  const std::string* args;
+  pack_entry ent;
+};
+
+static void
+save_pack_entry (FILE* fp, const pack_entry& ent)
+{
+  assert (fwrite (&ent, sizeof ent, 1, fp) == 1);
+}
+
+static void
+load_pack_entry (FILE* fp, pack_entry* ent)
+{
+  assert (fread (ent, sizeof *ent, 1, fp) == 1);
+}
+
+static void
+save_unit_record (FILE* fp, const void* arg)
+{
+  const unit_record* rec = (const unit_record*) arg;
+  save_int32 (fp, JR_UNIT);
+  save_int32 (fp, rec->id);
+  save_string (fp, *rec->args);
+  save_pack_entry (fp, rec->ent);
+}
+
+static void
+save_ld_units (FILE* fp, const std::map<int, std::set<int> >& lds)
+{
+  save_int32 (fp, lds.size ());
+  std::map<int, std::set<int> >::const_iterator it;
+  for (it = lds.begin (); it != lds.end (); ++ it)
+    {
+      save_int32 (fp, it->first);
+      save_int32 (fp, it->second.size ());
+      std::set<int>::const_iterator jt;
+      for (jt = it->second.begin (); jt != it->second.end (); ++ jt)
+	save_int32 (fp, *jt);
+    }
+}
+
+static void
+load_ld_units (FILE* fp, std::map<int, std::set<int> >* lds)
+{
+  int size;
+  load_int32 (fp, &size);
+  for (int i = 0; i < size; ++ i)
+    {
+      int ld;
+      load_int32 (fp, &ld);
+      lds->insert (std::make_pair (ld, std::set<int> ()));
+      int unit_size;
+      load_int32 (fp, &unit_size);
+      for (int j = 0; j < unit_size; ++ j)
+	{
+	  int id;
+	  load_int32 (fp, &id);
+	  lds->find (ld)->second.insert (id);
+	}
+    }
+}
+
+void
+set_data::save (const std::string& path) const
+{
+  std::string tmp;
+  FILE* fp = open_save (path, &tmp);
+
+  unit_map.save (fp, save_string);
+  ld_map.save (fp, save_string);
+
+  save_ld_units (fp, ld_units);
+  save_ld_units (fp, ld_changed);
+
+  save_int32 (fp, ld_digests.size ());
+  std::map<int, uint64_t>::const_iterator dt;
+  for (dt = ld_digests.begin (); dt != ld_digests.end (); ++ dt)
+    {
+      save_int32 (fp, dt->first);
+      assert (fwrite (&dt->second, sizeof dt->second, 1, fp) == 1);
+    }
+
+  save_int32 (fp, ld_stamps.size ());
+  std::map<int, ld_stamp>::const_iterator st;
+  for (st = ld_stamps.begin (); st != ld_stamps.end (); ++ st)
+    {
+      save_int32 (fp, st->first);
+      assert (fwrite (&st->second, sizeof st->second, 1, fp) == 1);
+    }
+
+  save_int32 (fp, entries.size ());
+  std::map<std::pair<int, int>, pack_entry>::const_iterator ent;
+  for (ent = entries.begin (); ent != entries.end (); ++ ent)
+    {
+      save_int32 (fp, ent->first.first);
+      save_int32 (fp, ent->first.second);
+      save_pack_entry (fp, ent->second);
+    }
+
+  close_save (fp, path, tmp);
+}
+
+void
+set_data::load_index (const std::string& path)
+{
+  FILE* fp = fopen (path.c_str (), "rb");
+  if (! fp)
+    return;
+
+  unit_map.load (fp, load_string);
+  ld_map.load (fp, load_string);
+
+  load_ld_units (fp, &ld_units);
+  load_ld_units (fp, &ld_changed);
+
+  int size;
+  load_int32 (fp, &size);
+  for (int i = 0; i < size; ++ i)
+    {
+      int ld;
+      load_int32 (fp, &ld);
+      uint64_t digest;
+      assert (fread (&digest, sizeof digest, 1, fp) == 1);
+      ld_digests.insert (std::make_pair (ld, digest));
+    }
+
+  load_int32 (fp, &size);
+  for (int i = 0; i < size; ++ i)
+    {
+      int ld;
+      load_int32 (fp, &ld);
+      ld_stamp stamp;
+      assert (fread (&stamp, sizeof stamp, 1, fp) == 1);
+      ld_stamps.insert (std::make_pair (ld, stamp));
+    }
+
+  load_int32 (fp, &size);
+  for (int i = 0; i < size; ++ i)
+    {
+      int ld, id;
+      load_int32 (fp, &ld);
+      load_int32 (fp, &id);
+      pack_entry ent;
+      load_pack_entry (fp, &ent);
+      entries.insert (std::make_pair (std::make_pair (ld, id), ent));
+    }
+
+  fclose (fp);
+}
+
+void
+set_data::replay (const std::string& path)
+{
+  std::string journal;
+  if (! read_records (path, &journal))
+    return;
+
+  std::vector<char> buf;
+  size_t pos = 0;
+  while (read_record (journal, &pos, &buf))
+    {
+      FILE* rec = fmemopen (&buf[0], buf.size (), "rb");
+      assert (rec);
+
+      int type, id;
+      load_int32 (rec, &type);
+      load_int32 (rec, &id);
+      if (type == JR_UNIT)
+	{
+	  std::string args;
+	  load_string (rec, &args);
+	  if (! unit_map.contains (id)
+	      && ((const id_map<std::string>&) unit_map).get (args) == 0)
+	    unit_map.set (id, args);
+	  pack_entry ent;
+	  load_pack_entry (rec, &ent);
+	  entries[std::make_pair (0, id)] = ent;
+
+	  // Linkage containing the rebuilt unit is out of date, its
+	  // files are kept for relinking
+	  std::map<int, std::set<int> >::const_iterator it;
+	  for (it = ld_units.begin (); it != ld_units.end (); ++ it)
+	    if (it->second.find (id) != it->second.end ())
+	      ld_changed[it->first].insert (id);
+	}
+      else
+	assert (false);
+
+      fclose (rec);
+    }
+}
+
+void
+set_data::clear ()
+{
+  unit_map.clear ();
+  ld_map.clear ();
+  ld_units.clear ();
+  ld_changed.clear ();
+  ld_digests.clear ();
+  ld_stamps.clear ();
+  entries.clear ();
+  if (pack != -1)
+    close (pack);
+  pack = -1;
+}
+
+void
+set_data::open_pack (const std::string& db)
+{
+  pack = open (pack_path (db).c_str (), O_RDONLY);
+  assert (pack != -1 || entries.empty ());
+}
+
+bool
+set_data::load (const std::string& db)
+{
+  int fd = lock_journal (db, LOCK_SH);
+  load_index (index_path (db));
+  replay (journal_path (db));
+  open_pack (db);
+
+  struct stat st;
+  assert (fstat (fd, &st) == 0);
+  close (fd);
+  return st.st_size != 0;
+}
+
+set_lock::set_lock (const std::string& db, set_data* data)
+  : db (db), data (data)
+{
+  fd = lock_journal (db, LOCK_EX);
+  data->clear ();
+  data->load_index (index_path (db));
+  data->replay (journal_path (db));
+  data->open_pack (db);
+}
+
+set_lock::~set_lock ()
+{
+  data->save (index_path (db));
+  assert (unlink (journal_path (db).c_str ()) == 0);
+  close (fd);
+}
+
+pack_writer::pack_writer (const std::string& db)
+{
+  std::string path = pack_path (db);
+  while (true)
+    {
+      fd = open (path.c_str (), O_RDWR | O_CREAT | O_APPEND, 0644);
+      assert (fd != -1);
+      assert (flock (fd, LOCK_EX) == 0);
+
+      struct stat st;
+      assert (fstat (fd, &st) == 0);
+      ino = st.st_ino;
+      if (st.st_nlink)
+	break;
+      close (fd);
+    }
+}
+
+pack_writer::~pack_writer ()
+{
+  close (fd);
+}
+
+// Entries are 8 bytes aligned for the sections mapped in place
+pack_entry
+pack_writer::append (const std::string& data)
+{
+  struct stat st;
+  assert (fstat (fd, &st) == 0);
+  pack_entry ent = { ((uint64_t) st.st_size + 7) & ~(uint64_t) 7,
+		     data.size () };
+
+  std::string buf (ent.offset - st.st_size, '\0');
+  buf += data;
+  assert (write (fd, buf.c_str (), buf.size ()) == (ssize_t) buf.size ());
+  return ent;
+}
+
+pack_entry
+pack_writer::append (FILE* fp)
+{
+  assert (fflush (fp) == 0);
+  struct stat st, fst;
+  assert (fstat (fd, &st) == 0);
+  assert (fstat (fileno (fp), &fst) == 0);
+  pack_entry ent = { ((uint64_t) st.st_size + 7) & ~(uint64_t) 7,
+		     (uint64_t) fst.st_size };
+
+  std::string pad (ent.offset - st.st_size, '\0');
+  assert (write (fd, pad.c_str (), pad.size ()) == (ssize_t) pad.size ());
+  rewind (fp);
+  char buf[65536];
+  size_t n;
+  while ((n = fread (buf, 1, sizeof buf, fp)) > 0)
+    assert (write (fd, buf, n) == (ssize_t) n);
+  return ent;
+}
+
+// The next unit id, O_APPEND makes the file size an atomic
+// counter without locking
+static int
+next_unit_id (const std::string& db)
+{
+  int fd = open (ids_path (db).c_str (),
+		 O_WRONLY | O_CREAT | O_APPEND, 0644);
+  assert (fd != -1);
+  assert (write (fd, "", 1) == 1);
+  off_t id = lseek (fd, 0, SEEK_CUR);
+  assert (id > 0 && id <= INT_MAX);
+  close (fd);
+  return id;
+}
+
+// The unit id of the arguments. Each arguments gets a key file
+// under db/keys named by its hash, so processes compiling
+// different units never contend on the same lock.
+static int
+unit_id (const std::string& db, const std::string& args)
+{
+  char hash[17];
+  snprintf (hash, sizeof hash, "%016llx",
+	    (unsigned long long) hash_string (args));
+
+  for (int n = 0; ; ++ n)
+    {
+      std::string path = joinpath (keys_path (db).c_str (), hash, NULL);
+      if (n) path += '.' + tostr (n);
+
+      int fd = open (path.c_str (), O_RDWR | O_CREAT, 0644);
+      assert (fd != -1);
+      assert (flock (fd, LOCK_EX) == 0);
+
+      FILE* fp = fdopen (fd, "r+b");
+      assert (fp);
+
+      int id;
+      std::string key;
+      if (fread (&id, sizeof id, 1, fp) != 1)
+	{
+	  // A new one or left empty by a crashed process, whose id
+	  // becomes a hole as it's never journaled
+	  id = next_unit_id (db);
+	  assert (fseek (fp, 0, SEEK_SET) == 0);
+	  save_int32 (fp, id);
+	  save_string (fp, args);
+	  fclose (fp);
+	  return id;
+	}
+
+      load_string (fp, &key);
+      fclose (fp);
+      if (key == args)
+	return id;
+      // Collided, try the next
+    }
+}
+
+static std::string
+paths_path (const std::string& db)
+{
+  return joinpath (db.c_str (), "paths", NULL);
+}
+
+static void
+save_path_record (FILE* fp, const void* arg)
+{
+  const std::pair<const std::string, std::string>* path;
+  path = (const std::pair<const std::string, std::string>*) arg;
+  save_string (fp, path->first);
+  save_string (fp, path->second);
+}
+
+void
+path_cache::load (const std::string& db)
+{
+  this->db = db;
+
+  std::string records;
+  if (! read_records (paths_path (db), &records))
+    return;
+
+  std::vector<char> buf;
+  size_t pos = 0;
+  while (read_record (records, &pos, &buf))
+    {
+      FILE* rec = fmemopen (&buf[0], buf.size (), "rb");
+      assert (rec);
+      std::string file, full;
+      load_string (rec, &file);
+      load_string (rec, &full);
+      paths.insert (std::make_pair (file, full));
+      fclose (rec);
+    }
+}
+
+const std::string&
+path_cache::get (const char* file)
+{
+  if (cwd.empty ())
+    {
+      char* dir = getcwd (NULL, 0);
+      assert (dir);
+      cwd = dir;
+      free (dir);
+    }
+
+  // Relative names are keyed by the working directory
+  std::string key = file[0] == '/' ? file : cwd + '/' + file;
+  std::map<std::string, std::string>::iterator it = paths.find (key);
+  if (it != paths.end ())
+    return it->second;
+
+  ++ resolves;
+  char* full = realpath (file, NULL);
+  it = paths.insert (std::make_pair (key, full ? full : "")).first;
+  free (full);
+
+  if (full && ! db.empty ())
+    {
+      int fd = open (paths_path (db).c_str (),
+		     O_WRONLY | O_CREAT | O_APPEND, 0644);
+      assert (fd != -1);
+      append_record (fd, save_path_record, &*it);
+      close (fd);
+    }
+  return it->second;
+}
+
+set::set (const char* db, int flags, int compress)
+  : log (stderr, flags & SF_TRACE),
+    db (db), dump (flags & SF_DUMP), compress (compress),
+    cur_id (0), cur_data (NULL)
+{
+  trace ("open %s\n", db);
+  mkdir (keys_path (db).c_str (), 0755);
+  if (flags & SF_PATHS)
+    paths.load (db);
+}
+
+set::~set ()
+{
+  if (cur_id)
+    save_current_unit ();
+}
+
+void
+set::next (const std::string& args, const std::string& input)
+{
+  if (cur_id)
+    save_current_unit ();
+
+  cur_id = unit_id (db, args);
+  cur_args = args;
+  cur = unit (&log, input, &paths);
+  paths.resolves = 0;
+  trace ("unit %d\n", cur_id);
+}
+
+void
+set::save_current_unit ()
+{
+  if (dump)
+    {
+      fprintf (stderr, "unit %s:\n", cur_args.c_str ());
+      cur.dump (stderr, 1);
+    }
+  std::string file;
+  cur.save (&file, compress);
+
+  // Journal the entry before unlocking the pack, so it isn't
+  // repacked away meanwhile
+  pack_writer pack (db);
+  unit_record rec = { cur_id, &cur_args, pack.append (file) };
+  append_journal (db, save_unit_record, &rec);
+}
+
+static void
+save_unit_fid (FILE* fp, const unit_fid& fid)
+{
+  save_int32 (fp, fid.unit);
+  save_int32 (fp, fid.fid);
+}
+
+static void
+load_unit_fid (FILE* fp, unit_fid* fid)
+{
+  load_int32 (fp, &fid->unit);
+  load_int32 (fp, &fid->fid);
+}
+
+void
+file_set::save (std::string* out, int level) const
+{
+  char* buf;
+  size_t size;
+  FILE* fp = open_memstream (&buf, &size);
+  assert (fp);
+
+  file_map.save (fp, save_string);
+
+  save_int32 (fp, files.size ());
+  std::map<unit_fid, int>::const_iterator file;
+  for (file = files.begin (); file != files.end (); ++ file)
+    {
+      save_unit_fid (fp, file->first);
+      save_int32 (fp, file->second);
+    }
+
+  save_int32 (fp, file_units.size ());
+  std::map<int, std::set<unit_fid> >::const_iterator unit;
+  for (unit = file_units.begin (); unit != file_units.end (); ++ unit)
+    {
+       save_int32 (fp, unit->first);
+       save_int32 (fp, unit->second.size ());
+       std::set<unit_fid>::const_iterator fid;
+       for (fid = unit->second.begin ();
+	    fid != unit->second.end ();
+	    ++ fid)
+	 save_unit_fid (fp, *fid);
+    }
+
+  assert (fclose (fp) == 0);
+  encode_file (out, std::string (buf, size), level);
+  free (buf);
+}
+
+void
+file_set::load (int pack, const pack_entry& ent)
+{
+  mapped_file data;
+  data.load (pack, ent);
+  FILE* fp = fmemopen ((void*) data.bytes (0, data.size), data.size, "rb");
+  assert (fp);
+
+  file_map.load (fp, load_string);
+
+  int file_size;
+  load_int32 (fp, &file_size);
+  for (int i = 0; i < file_size; ++ i)
+    {
+      unit_fid ufid;
+      load_unit_fid (fp, &ufid);
+      int fid;
+      load_int32 (fp, &fid);
+      files.insert (std::make_pair (ufid, fid));
+    }
+
+  int file_unit_size;
+  load_int32 (fp, &file_unit_size);
+  for (int i = 0; i < file_unit_size; ++ i)
+    {
+      int fid;
+      load_int32 (fp, &fid);
+      int unit_size;
+      load_int32 (fp, &unit_size);
+      std::set<unit_fid> units;
+      for (int j = 0; j < unit_size; ++ j)
+	{
+	  unit_fid ufid;
+	  load_unit_fid (fp, &ufid);
+	  units.insert (ufid);
+	}
+      file_units.insert (std::make_pair (fid, units));
+    }
+
+  fclose (fp);
+}
+
+set_usr::set_usr (const std::string& db)
+  : db (db), progress (NULL), progress_arg (NULL)
+{
+  if (data.load (db))
+    set_lock lock (db, &data);
+}
+
+struct parallel_job
+{
+  void (* fn)(void*, int);
+  void* arg;
+  int n;
+  int next;
+};
+
+static void*
+parallel_worker (void* arg)
+{
+  parallel_job* job = (parallel_job*) arg;
+  int i;
+  while ((i = __sync_fetch_and_add (&job->next, 1)) < job->n)
+    job->fn (job->arg, i);
+  return NULL;
+}
+
+// A thread per processor, or $GCJ_THREADS
+static int
+parallel_threads ()
+{
+  const char* env = getenv ("GCJ_THREADS");
+  long n = env ? atoi (env) : sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+// Call fn (arg, i) for each i below n in parallel
+static void
+run_parallel (void (* fn)(void*, int), void* arg, int n)
+{
+  parallel_job job = { fn, arg, n, 0 };
+  std::vector<pthread_t> threads (std::max (std::min (parallel_threads (),
+						      n) - 1, 0));
+  for (size_t t = 0; t < threads.size (); ++ t)
+    assert (pthread_create (&threads[t], NULL, parallel_worker, &job) == 0);
+  parallel_worker (&job);
+  for (size_t t = 0; t < threads.size (); ++ t)
+    assert (pthread_join (threads[t], NULL) == 0);
+}
+
+struct files_state
+{
+  set_usr* set;
+  std::vector<int> units;
+  // (fid, real path) of the files of each unit
+  std::vector<std::vector<std::pair<int, std::string> > > files;
+};
+
+static void
+read_files (void* arg, int i)
+{
+  files_state* st = (files_state*) arg;
+  unit tmp;
+  const unit* unit = st->set->peek (st->units[i], &tmp);
+  std::map<int, std::set<int> >::const_iterator it;
+  for (it = unit->get_file_includes ().begin ();
+       it != unit->get_file_includes ().end (); ++ it)
+    {
+      char* full = realpath (unit->get_file (it->first).c_str (), NULL);
+      if (! full)
+	continue;
+      st->files[i].push_back (std::make_pair (it->first, std::string (full)));
+      free (full);
+    }
+}
+
+void
+set_usr::build_files (int ld, const std::set<int>& units, int level,
+		      int base, const std::set<int>* changed,
+		      pack_writer* pack,
+		      std::map<std::pair<int, int>, pack_entry>* entries)
+{
+  // The units are read in parallel, then numbered in order. When
+  // relinking, the files of the unchanged units are kept.
+  files_state st;
+  st.set = this;
+  file_set fset;
+  std::pair<int, int> key (base, 0);
+  if (changed && data.entries.find (key) != data.entries.end ())
+    {
+      fset.load (data.pack, data.entries.at (key));
+      std::set<int>::const_iterator it;
+      for (it = changed->begin (); it != changed->end (); ++ it)
+	{
+	  std::map<unit_fid, int>::iterator first, last, jt;
+	  first = fset.files.lower_bound (unit_fid (*it, 0));
+	  last = fset.files.lower_bound (unit_fid (*it + 1, 0));
+	  for (jt = first; jt != last; ++ jt)
+	    {
+	      std::set<unit_fid>* ufids = &fset.file_units.at (jt->second);
+	      ufids->erase (jt->first);
+	      if (ufids->empty ())
+		fset.file_units.erase (jt->second);
+	    }
+	  fset.files.erase (first, last);
+	  if (units.find (*it) != units.end ())
+	    st.units.push_back (*it);
+	}
+    }
+  else
+    st.units.assign (units.begin (), units.end ());
+  st.files.resize (st.units.size ());
+  run_parallel (read_files, &st, st.units.size ());
+
+  for (size_t i = 0; i < st.units.size (); ++ i)
+    {
+      std::vector<std::pair<int, std::string> >::const_iterator it;
+      for (it = st.files[i].begin (); it != st.files[i].end (); ++ it)
+	{
+	  int set_fid = fset.file_map.get (it->second);
+
+	  unit_fid ufid (st.units[i], it->first);
+	  fset.files.insert (std::make_pair (ufid, set_fid));
+	  if (fset.file_units.find (set_fid) == fset.file_units.end ())
+	    fset.file_units.insert (std::make_pair (set_fid,
+						    std::set<unit_fid> ()));
+	  fset.file_units.find (set_fid)->second.insert (ufid);
+	}
+    }
+
+  std::string file;
+  fset.save (&file, level);
+  (*entries)[std::make_pair (ld, 0)] = pack->append (file);
+}
+
+// The records of a link are sorted by their bytes, so the keys in
+// front are big endian and the names end with NUL
+static void
+put_key (std::string* rec, int v)
+{
+  for (int s = 24; s >= 0; s -= 8)
+    *rec += (char) ((uint32_t) v >> s);
+}
+
+static int
+get_key (const char** p)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 4; ++ i)
+    v = v << 8 | (unsigned char) *(*p) ++;
+  return v;
+}
+
+static void
+put_name (std::string* rec, const std::string& name)
+{
+  rec->append (name.c_str (), name.size () + 1);
+}
+
+static std::string
+get_name (const char** p)
+{
+  std::string name (*p);
+  *p += name.size () + 1;
+  return name;
+}
+
+static void
+put_int (std::string* rec, int v)
+{
+  rec->append ((const char*) &v, sizeof v);
+}
+
+static int
+get_int (const char** p)
+{
+  int v;
+  memcpy (&v, *p, sizeof v);
+  *p += sizeof v;
+  return v;
+}
+
+static void
+put_from (std::string* rec, const jump_from& from)
+{
+  put_int (rec, from.loc.line);
+  put_int (rec, from.loc.col);
+  put_int (rec, from.len);
+  put_int (rec, from.expanded_id);
+}
+
+static jump_from
+get_from (const char** p)
+{
+  int line = get_int (p);
+  int col = get_int (p);
+  int len = get_int (p);
+  int expanded_id = get_int (p);
+  return jump_from (file_location (line, col), len, expanded_id);
+}
+
+static void
+put_to (std::string* rec, const jump_to& to)
+{
+  put_int (rec, to.unit);
+  put_int (rec, to.include);
+  put_int (rec, to.point);
+  put_int (rec, to.loc.line);
+  put_int (rec, to.loc.col);
+  put_int (rec, to.expanded_id);
+  put_int (rec, to.exp);
+}
+
+static jump_to
+get_to (const char** p)
+{
+  int unit = get_int (p);
+  int include = get_int (p);
+  int point = get_int (p);
+  int line = get_int (p);
+  int col = get_int (p);
+  jump_to to (unit, include, point, file_location (line, col),
+	      get_int (p));
+  to.exp = get_int (p);
+  return to;
+}
+
+// The state of a unit in a link is kept in its own files, its
+// symbols and the records keyed by it, so the ones of the units not
+// relinked are shared like their overlays. A file is the sections of
+// the records, each grouped by the names and compressed like the
+// other files:
+//   "GCJL" count { name count { fields } ... } ...
+// The fields after the names and the keys are in varints.
+static const char state_magic[4] = { 'G', 'C', 'J', 'L' };
+
+enum state_section
+{
+  SS_SYMS,
+  SS_JUMPS,
+  SS_BACKS
+};
+
+// The name of a record of the section and its fields
+static const char*
+record_fields (const std::string& rec, state_section sec,
+	       std::string* name)
+{
+  const char* q = rec.c_str ();
+  if (sec != SS_SYMS)
+    get_key (&q);
+  *name = get_name (&q);
+  if (sec == SS_SYMS)
+    get_key (&q);
+  return q;
+}
+
+static void
+save_fields (std::string* out, const char** q, int keys, int ints)
+{
+  for (; keys; -- keys)
+    save_varint (out, get_key (q));
+  for (; ints; -- ints)
+    save_zigzag (out, get_int (q));
+}
+
+static void
+load_fields (std::string* rec, const unsigned char** p,
+	     const unsigned char* end, int keys, int ints)
+{
+  for (; keys; -- keys)
+    put_key (rec, load_varint (p, end));
+  for (; ints; -- ints)
+    put_int (rec, load_zigzag (p, end));
+}
+
+// The sources of a symbol are an include and a jump_from each, its
+// target a jump_to, weak and init. A jump is k, include, jump_from
+// and jump_to, a back is k, r, jump_to, len and jump_to.
+static void
+save_record (std::string* out, const char* q, state_section sec)
+{
+  if (sec == SS_JUMPS)
+    save_fields (out, &q, 1, 12);
+  else if (sec == SS_BACKS)
+    save_fields (out, &q, 2, 15);
+  else
+    {
+      char kind = *q ++;
+      *out += kind;
+      if (kind == '\0')
+	{
+	  int n = get_int (&q);
+	  save_varint (out, n);
+	  save_fields (out, &q, 0, n * 5);
+	}
+      else
+	{
+	  save_fields (out, &q, 0, 7);
+	  out->append (q, 2);
+	}
+    }
+}
+
+static void
+load_record (std::string* rec, const unsigned char** p,
+	     const unsigned char* end, state_section sec)
+{
+  if (sec == SS_JUMPS)
+    load_fields (rec, p, end, 1, 12);
+  else if (sec == SS_BACKS)
+    load_fields (rec, p, end, 2, 15);
+  else
+    {
+      assert (*p < end);
+      char kind = *(*p) ++;
+      *rec += kind;
+      if (kind == '\0')
+	{
+	  int n = load_varint (p, end);
+	  put_int (rec, n);
+	  load_fields (rec, p, end, 0, n * 5);
+	}
+      else
+	{
+	  load_fields (rec, p, end, 0, 7);
+	  assert (*p + 2 <= end);
+	  rec->append ((const char*) *p, 2);
+	  *p += 2;
+	}
+    }
+}
+
+// The records are sorted, so the ones of a name are together
+static void
+save_section (std::string* out, const std::vector<std::string>& recs,
+	      state_section sec)
+{
+  std::vector<size_t> firsts;
+  std::string name, next;
+  for (size_t i = 0; i < recs.size (); ++ i)
+    {
+      record_fields (recs[i], sec, &next);
+      if (firsts.empty () || next != name)
+	firsts.push_back (i);
+      name.swap (next);
+    }
+  firsts.push_back (recs.size ());
+
+  save_varint (out, firsts.size () - 1);
+  for (size_t g = 0; g + 1 < firsts.size (); ++ g)
+    {
+      record_fields (recs[firsts[g]], sec, &name);
+      put_name (out, name);
+      save_varint (out, firsts[g + 1] - firsts[g]);
+      for (size_t i = firsts[g]; i < firsts[g + 1]; ++ i)
+	save_record (out, record_fields (recs[i], sec, &name), sec);
+    }
+}
+
+static void
+load_section (const unsigned char** p, const unsigned char* end, int unit,
+	      state_section sec, std::vector<std::string>* recs)
+{
+  for (uint32_t g = load_varint (p, end); g; -- g)
+    {
+      const void* nul = memchr (*p, 0, end - *p);
+      assert (nul);
+      std::string name ((const char*) *p);
+      *p = (const unsigned char*) nul + 1;
+      for (uint32_t n = load_varint (p, end); n; -- n)
+	{
+	  std::string rec;
+	  if (sec != SS_SYMS)
+	    put_key (&rec, unit);
+	  put_name (&rec, name);
+	  if (sec == SS_SYMS)
+	    put_key (&rec, unit);
+	  load_record (&rec, p, end, sec);
+	  recs->push_back (std::string ());
+	  recs->back ().swap (rec);
+	}
+    }
+}
+
+// The symbols of a unit, or its jumps and backs
+static void
+save_state (std::string* out, int level, const std::vector<std::string>& recs,
+	    const std::vector<std::string>* backs)
+{
+  std::string data (state_magic, sizeof state_magic);
+  save_section (&data, recs, backs ? SS_JUMPS : SS_SYMS);
+  if (backs)
+    save_section (&data, *backs, SS_BACKS);
+  encode_file (out, data, level);
+}
+
+// False if the unit has none in the link
+static bool
+load_state (const set_data& data, const std::pair<int, int>& key, int unit,
+	    std::vector<std::string>* recs, std::vector<std::string>* backs)
+{
+  std::map<std::pair<int, int>, pack_entry>::const_iterator ent;
+  if ((ent = data.entries.find (key)) == data.entries.end ())
+    return false;
+
+  mapped_file file;
+  file.load (data.pack, ent->second);
+  const unsigned char* p = (const unsigned char*) file.bytes (0, file.size);
+  const unsigned char* end = p + file.size;
+  assert (file.size >= sizeof state_magic
+	  && memcmp (p, state_magic, sizeof state_magic) == 0);
+  p += sizeof state_magic;
+  load_section (&p, end, unit, backs ? SS_JUMPS : SS_SYMS, recs);
+  if (backs)
+    load_section (&p, end, unit, SS_BACKS, backs);
+  assert (p == end);
+  return true;
+}
+
+// The keys of the files of the state of a unit in a link, -1 is the
+// level of the link
+static std::pair<int, int>
+sym_key (int ld, int unit)
+{
+  return std::make_pair (ld, -2 * unit);
+}
+
+static std::pair<int, int>
+record_key (int ld, int unit)
+{
+  return std::make_pair (ld, -2 * unit - 1);
+}
+
+// An unlinked temporary file in the database
+static FILE*
+open_spool (const std::string& db)
+{
+  std::string path = joinpath (db.c_str (), "sort.XXXXXX", NULL);
+  int fd = mkstemp (&path[0]);
+  assert (fd != -1);
+  assert (unlink (path.c_str ()) == 0);
+  FILE* fp = fdopen (fd, "w+");
   assert (fp);
+  return fp;
+}
+
+static void
+write_record (FILE* fp, const std::string& rec)
+{
+  save_int32 (fp, rec.size ());
+  assert (fwrite (rec.c_str (), 1, rec.size (), fp) == rec.size ());
+}
+
+// Read the next record, false at the end of the file or of a
+// section ended by -1
+static bool
+read_record (FILE* fp, std::string* rec)
+{
+  int32_t len;
+  if (fread (&len, sizeof len, 1, fp) != 1 || len < 0)
+    return false;
+  rec->resize (len);
+  assert (fread (&(*rec)[0], 1, len, fp) == (size_t) len);
+  return true;
+}
+
+// Sorts records within a memory budget. A full buffer is sorted
+// and spilled as a run to an unlinked file in the database, the
+// runs are merged when the records are read back. To keep few files
+// open, every sorter_merge runs of a level are merged into one of
+// the next level as they are spilled.
+static const size_t sorter_merge = 16;
+
+struct record_sorter
+{
+  record_sorter (const std::string& db, size_t budget);
+  ~record_sorter ();
+
+  // Thread safe
+  void add (const std::string& rec);
+  // The records in order, false at the end
+  bool next (std::string* rec);
+
+  void spill ();
+  // Merge the runs from first on into one
+  void merge (size_t first);
+
+  std::string db;
+  size_t budget;
+  pthread_mutex_t mutex;
+
+  size_t size;
+  std::vector<std::string> recs;
+  std::vector<FILE*> runs;
+  // The level of each run, the number of merges it went through
+  std::vector<int> levels;
+
+  bool reading;
+  size_t pos;
+  // The next record of each run
+  std::priority_queue<std::pair<std::string, int>,
+		      std::vector<std::pair<std::string, int> >,
+		      std::greater<std::pair<std::string, int> > > heads;
+};
+
+record_sorter::record_sorter (const std::string& db, size_t budget)
+  : db (db), budget (budget), size (0), reading (false), pos (0)
+{
+  assert (pthread_mutex_init (&mutex, NULL) == 0);
+}
+
+record_sorter::~record_sorter ()
+{
+  for (size_t i = 0; i < runs.size (); ++ i)
+    fclose (runs[i]);
+  pthread_mutex_destroy (&mutex);
+}
+
+void
+record_sorter::add (const std::string& rec)
+{
+  assert (pthread_mutex_lock (&mutex) == 0);
+  assert (! reading);
+  recs.push_back (rec);
+  size += sizeof rec + rec.size ();
+  if (size > budget)
+    spill ();
+  assert (pthread_mutex_unlock (&mutex) == 0);
+}
+
+void
+record_sorter::spill ()
+{
+  FILE* run = open_spool (db);
+  std::sort (recs.begin (), recs.end ());
+  std::vector<std::string>::const_iterator it;
+  for (it = recs.begin (); it != recs.end (); ++ it)
+    write_record (run, *it);
+  rewind (run);
+  runs.push_back (run);
+  levels.push_back (0);
+
+  std::vector<std::string> ().swap (recs);
+  size = 0;
+
+  // The levels of the runs never increase, the last ones of the
+  // same level are merged
+  while (true)
+    {
+      size_t first = runs.size ();
+      while (first > 0 && levels[first - 1] == levels.back ())
+	-- first;
+      if (runs.size () - first < sorter_merge)
+	break;
+      merge (first);
+    }
+}
+
+void
+record_sorter::merge (size_t first)
+{
+  FILE* run = open_spool (db);
+  std::priority_queue<std::pair<std::string, int>,
+		      std::vector<std::pair<std::string, int> >,
+		      std::greater<std::pair<std::string, int> > > heads;
+  std::string head;
+  for (size_t i = first; i < runs.size (); ++ i)
+    if (read_record (runs[i], &head))
+      heads.push (std::make_pair (head, i));
+  while (! heads.empty ())
+    {
+      int i = heads.top ().second;
+      write_record (run, heads.top ().first);
+      heads.pop ();
+      if (read_record (runs[i], &head))
+	heads.push (std::make_pair (head, i));
+    }
+  rewind (run);
+
+  int level = levels.back () + 1;
+  for (size_t i = first; i < runs.size (); ++ i)
+    fclose (runs[i]);
+  runs.resize (first);
+  levels.resize (first);
+  runs.push_back (run);
+  levels.push_back (level);
+}
+
+bool
+record_sorter::next (std::string* rec)
+{
+  if (! reading)
+    {
+      reading = true;
+      if (runs.empty ())
+	std::sort (recs.begin (), recs.end ());
+      else
+	{
+	  if (! recs.empty ())
+	    spill ();
+	  for (size_t i = 0; i < runs.size (); ++ i)
+	    {
+	      std::string head;
+	      if (read_record (runs[i], &head))
+		heads.push (std::make_pair (head, i));
+	    }
+	}
+    }
+
+  // All in memory
+  if (runs.empty ())
+    {
+      if (pos == recs.size ())
+	return false;
+      rec->swap (recs[pos ++]);
+      return true;
+    }
+
+  if (heads.empty ())
+    return false;
+  int i = heads.top ().second;
+  *rec = heads.top ().first;
+  heads.pop ();
+  std::string head;
+  if (read_record (runs[i], &head))
+    heads.push (std::make_pair (head, i));
+  return true;
+}
+
+// A link streams the public symbols of the units through sorted
+// records, spilled to the database beyond the memory budget
+// ($GCJ_LINK_MEMORY megabytes, 1024 by default). The phases:
+//   read the symbols of the units, keyed by the names and
+//   partitioned by their hash,
+//   resolve the names of each partition to the edges from the
+//   declarations to the definitions, keyed by the declaring units,
+//   find the referrers of the declarations of a batch of units,
+//   keyed by the defining units to back them,
+//   build the overlays of a batch of units and append them.
+// Each runs in parallel over the partitions or the units of a
+// batch. The keys keep the order of a serial link.
+//
+// The records are kept in the pack as the state of the link, the
+// symbols and the records of each unit in files next to its overlay,
+// see save_state. Relinking reads the symbols of the changed units
+// only, and resolves only their names again, with the records of the
+// other units from the state. Only the overlays with records of
+// these names are built again, the other units keep their files.
+//
+// The link of another ld with about the same units is relinked
+// the same way, sharing the files of its other units. An ld with
+// the same units as another one shares all its files, and the files
+// of the symbols of a unit are shared by the lds linking it.
+struct link_state
+{
+  link_state (set_usr* set, const std::set<int>& units);
+  ~link_state ();
+
+  // Relink the units changed since the link of base
+  void relink (int base, const pack_entry& ent,
+	       const std::set<int>& changed);
+
+  set_usr* set;
+  std::vector<int> units;
+  int parts;
+  int level;
+  // Of a batch, and the sorters of a phase together
+  size_t budget;
+
+  bool relinking;
+  int base;
+  std::set<int> changed;
+  // The names resolved again
+  std::set<std::string> names;
+  // The units whose symbols are read, and their names if relinking
+  std::vector<int> fresh;
+  std::vector<std::vector<std::string> > fresh_names;
+  // The files of their symbols, of size 0 if there are none
+  std::vector<pack_entry> fresh_files;
+
+  std::vector<record_sorter*> syms;
+  record_sorter* edges;
+  record_sorter* jumps;
+  record_sorter* backs;
+
+  // The units of a batch, with their records and overlays
+  std::vector<int> batch;
+  std::vector<std::vector<std::string> > batch_jumps;
+  std::vector<std::vector<std::string> > batch_backs;
+  std::vector<std::string> files;
+  std::vector<std::string> states;
+
+  // The units with overlays built, the others are kept from the
+  // last link if relinking
+  std::set<int> linked;
+  // The pack appended to, the one the files kept or shared are in
+  ino_t pack;
+
+  // Of the phase running, see report
+  size_t done;
+  pthread_mutex_t report_lock;
+  struct timespec reported;
+};
+
+static size_t
+link_memory ()
+{
+  const char* env = getenv ("GCJ_LINK_MEMORY");
+  long n = env ? atoi (env) : 1024;
+  return (size_t) (n > 0 ? n : 1) << 20;
+}
 
-  unit_map.save (fp, save_string);
-  ld_map.save (fp, save_string);
+link_state::link_state (set_usr* set, const std::set<int>& units)
+  : set (set), units (units.begin (), units.end ()),
+    parts (parallel_threads ()), level (0), budget (link_memory () / 4),
+    relinking (false), base (0), fresh (units.begin (), units.end ()),
+    pack (0), done (0)
+{
+  assert (pthread_mutex_init (&report_lock, NULL) == 0);
+  reported.tv_sec = reported.tv_nsec = 0;
+
+  for (int p = 0; p < parts; ++ p)
+    syms.push_back (new record_sorter (set->db, budget / parts));
+  edges = new record_sorter (set->db, budget);
+  jumps = new record_sorter (set->db, budget / 2);
+  backs = new record_sorter (set->db, budget / 2);
+}
 
-  save_int32 (fp, ld_units.size ());
-  std::map<int, std::set<int> >::const_iterator it;
-  for (it = ld_units.begin (); it != ld_units.end (); ++ it)
+link_state::~link_state ()
+{
+  for (int p = 0; p < parts; ++ p)
+    delete syms[p];
+  delete edges;
+  delete jumps;
+  delete backs;
+  pthread_mutex_destroy (&report_lock);
+}
+
+// Count n more units or symbols done of the phase, reported at the
+// end or at most every 100ms
+static void
+report (link_state* st, const char* phase, size_t n, size_t total,
+	bool end)
+{
+  size_t done = __sync_add_and_fetch (&st->done, n);
+  set_usr* set = st->set;
+  if (! set->progress)
+    return;
+
+  assert (pthread_mutex_lock (&st->report_lock) == 0);
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (end || done == total
+      || (now.tv_sec - st->reported.tv_sec) * 1000000000L
+	 + now.tv_nsec - st->reported.tv_nsec >= 100000000L)
     {
-      save_int32 (fp, it->first);
-      save_int32 (fp, it->second.size ());
-      std::set<int>::const_iterator jt;
-      for (jt = it->second.begin (); jt != it->second.end (); ++ jt)
-	save_int32 (fp, *jt);
+      st->reported = now;
+      set->progress (set->progress_arg, phase, done, total);
     }
-
-  fclose (fp);
+  assert (pthread_mutex_unlock (&st->report_lock) == 0);
 }
 
 void
-set_data::load (const std::string& path)
+link_state::relink (int base, const pack_entry& ent,
+		    const std::set<int>& changed)
 {
-  FILE* fp = fopen (path.c_str (), "rb");
-  if (! fp)
-    return;
+  relinking = true;
+  this->base = base;
+  this->changed = changed;
 
-  unit_map.load (fp, load_string);
-  ld_map.load (fp, load_string);
+  mapped_file last;
+  last.load (set->data.pack, ent);
+  int32_t level;
+  memcpy (&level, last.bytes (0, sizeof level), sizeof level);
+  this->level = level;
 
-  int size;
-  load_int32 (fp, &size);
-  for (int i = 0; i < size; ++ i)
+  fresh.clear ();
+  std::set<int>::const_iterator it;
+  for (it = changed.begin (); it != changed.end (); ++ it)
+    if (std::binary_search (units.begin (), units.end (), *it))
+      fresh.push_back (*it);
+  fresh_names.resize (fresh.size ());
+}
+
+// The key and the name of a record of the jumps or the backs
+static int
+record_unit (const std::string& rec, std::string* name)
+{
+  const char* q = rec.c_str ();
+  int unit = get_key (&q);
+  *name = get_name (&q);
+  return unit;
+}
+
+static void
+read_syms (void* arg, int i)
+{
+  link_state* st = (link_state*) arg;
+  int id = st->fresh[i];
+  unit tmp;
+  const unit* unit = st->set->peek (id, &tmp);
+
+  // The sources of a name in a unit go before its target
+  std::vector<std::string> recs;
+  std::map<std::string, std::vector<jump_src> >::const_iterator it;
+  for (it = unit->get_pub_srcs ().begin ();
+       it != unit->get_pub_srcs ().end (); ++ it)
     {
-      int ld;
-      load_int32 (fp, &ld);
-      ld_units.insert (std::make_pair (ld, std::set<int> ()));
-      int unit_size;
-      load_int32 (fp, &unit_size);
-      for (int j = 0; j < unit_size; ++ j)
+      std::string rec;
+      put_name (&rec, it->first);
+      put_key (&rec, id);
+      rec += '\0';
+      put_int (&rec, it->second.size ());
+      std::vector<jump_src>::const_iterator jt;
+      for (jt = it->second.begin (); jt != it->second.end (); ++ jt)
 	{
-	  int id;
-	  load_int32 (fp, &id);
-	  ld_units.find (ld)->second.insert (id);
+	  put_int (&rec, jt->include);
+	  put_from (&rec, jt->from);
 	}
+      st->syms[hash_string (it->first) % st->parts]->add (rec);
+      recs.push_back (rec);
+      if (st->relinking)
+	st->fresh_names[i].push_back (it->first);
     }
 
-  fclose (fp);
+  std::map<std::string, jump_tgt>::const_iterator lt;
+  for (lt = unit->get_pub_tgts ().begin ();
+       lt != unit->get_pub_tgts ().end (); ++ lt)
+    {
+      std::string rec;
+      put_name (&rec, lt->first);
+      put_key (&rec, id);
+      rec += '\1';
+      put_to (&rec, lt->second.to);
+      rec += (char) lt->second.weak;
+      rec += (char) lt->second.init;
+      st->syms[hash_string (lt->first) % st->parts]->add (rec);
+      recs.push_back (rec);
+      if (st->relinking)
+	st->fresh_names[i].push_back (lt->first);
+    }
+
+  // The files of the link are compressed like the most compressed
+  // unit
+  int level = unit->file->data.level;
+  int old;
+  while ((old = st->level) < level
+	 && ! __sync_bool_compare_and_swap (&st->level, old, level))
+    ;
+
+  // The symbols of the state only depend on the unit, compressed
+  // like it. Appending locks the pack, and st->pack along with it.
+  if (! recs.empty () && ! st->fresh_files[i].size)
+    {
+      std::sort (recs.begin (), recs.end ());
+      std::string file;
+      save_state (&file, level, recs, NULL);
+      pack_writer pack (st->set->db);
+      if (! st->pack)
+	st->pack = pack.ino;
+      // Repacked while linking
+      if (pack.ino == st->pack)
+	st->fresh_files[i] = pack.append (file);
+    }
+
+  report (st, "scan", 1, st->fresh.size (), false);
 }
 
-set::set (const char* db, int flags)
-  : log (stderr, flags & SF_TRACE),
-    db (db), dump (flags & SF_DUMP), cur_id (0), cur_data (NULL)
+static void
+resolve_syms (void* arg, int p)
 {
-  trace ("load from %s\n", db);
-  data.load (index_path (db));
+  link_state* st = (link_state*) arg;
+  std::string name;
+  std::vector<std::pair<int, jump_src> > srcs;
+  bool defined = false;
+  jump_tgt tgt (jump_to (), false, false);
+
+  std::string rec;
+  bool more;
+  size_t names = 0;
+  do
+    {
+      more = st->syms[p]->next (&rec);
+      const char* q = rec.c_str ();
+      std::string next = more ? get_name (&q) : std::string ();
+      if (! more || next != name)
+	{
+	  if (++ names % 1024 == 0)
+	    report (st, "resolve", 1024, 0, false);
+	  for (size_t k = 0; defined && k < srcs.size (); ++ k)
+	    {
+	      std::string edge;
+	      put_key (&edge, srcs[k].first);
+	      put_name (&edge, name);
+	      put_key (&edge, k);
+	      put_int (&edge, srcs[k].second.include);
+	      put_from (&edge, srcs[k].second.from);
+	      put_to (&edge, tgt.to);
+	      st->edges->add (edge);
+	    }
+	  name = next;
+	  srcs.clear ();
+	  defined = false;
+	}
+      if (! more)
+	break;
+
+      int id = get_key (&q);
+      if (*q ++ == '\0')
+	{
+	  int n = get_int (&q);
+	  for (int k = 0; k < n; ++ k)
+	    {
+	      int include = get_int (&q);
+	      srcs.push_back (std::make_pair (id, jump_src (include,
+							    get_from (&q))));
+	    }
+	  continue;
+	}
+
+      jump_to to = get_to (&q);
+      jump_tgt lt (to, q[0], q[1]);
+      if (! defined)
+	{
+	  tgt = lt;
+	  defined = true;
+	}
+      else if (tgt.weak && ! lt.weak)
+	tgt = lt;
+      else if (tgt.init)
+	srcs.push_back (std::make_pair (id, jump_src (lt.to.include,
+						      jump_from (lt.to.loc,
+								 name.length (),
+								 lt.to.expanded_id))));
+      else
+	{
+	  srcs.push_back (std::make_pair (tgt.to.unit,
+					  jump_src (tgt.to.include,
+						    jump_from (tgt.to.loc,
+							       name.length (),
+							       tgt.to.expanded_id))));
+	  tgt = lt;
+	}
+    }
+  while (more);
+  report (st, "resolve", names % 1024, 0, false);
 }
 
-set::~set ()
+static void
+find_refs (void* arg, int i)
 {
-  if (cur_id)
-    save_current_unit ();
+  link_state* st = (link_state*) arg;
+  unit tmp;
+  const unit* base = st->set->peek (st->batch[i], &tmp);
 
-  trace ("save to %s\n", db.c_str ());
-  data.save (index_path (db));
+  std::vector<std::string>::const_iterator it;
+  for (it = st->batch_jumps[i].begin (); it != st->batch_jumps[i].end (); ++ it)
+    {
+      st->jumps->add (*it);
+
+      const char* q = it->c_str ();
+      get_key (&q);
+      std::string name = get_name (&q);
+      int k = get_key (&q);
+      int include = get_int (&q);
+      jump_from from = get_from (&q);
+      jump_to to = get_to (&q);
+
+      const context* ctx = base->get (include);
+      if (! ctx)
+	continue;
+      // Back from the definition to the referrers of the
+      // declaration, as add_back2 does
+      jump_backs bks = ctx->jump_back (from.loc, from.expanded_id);
+      for (const jump_to* bk = bks.first; bk != bks.last; ++ bk)
+	{
+	  std::string back;
+	  put_key (&back, to.unit);
+	  put_name (&back, name);
+	  put_key (&back, k);
+	  put_key (&back, bk - bks.first);
+	  put_to (&back, *bk);
+	  put_int (&back, from.len);
+	  put_to (&back, to);
+	  st->backs->add (back);
+	}
+    }
+  report (st, "refer", 1, 0, false);
 }
 
-void
-set::next (const std::string& args, const std::string& input)
+static void
+build_overlay (void* arg, int i)
 {
-  if (cur_id)
-    save_current_unit ();
+  link_state* st = (link_state*) arg;
+  unit overlay;
+
+  std::vector<std::string>::const_iterator it;
+  for (it = st->batch_jumps[i].begin (); it != st->batch_jumps[i].end (); ++ it)
+    {
+      const char* q = it->c_str ();
+      get_key (&q);
+      get_name (&q);
+      get_key (&q);
+      int include = get_int (&q);
+      jump_from from = get_from (&q);
+      overlay.get (include)->add (from, get_to (&q));
+    }
+
+  for (it = st->batch_backs[i].begin (); it != st->batch_backs[i].end (); ++ it)
+    {
+      const char* q = it->c_str ();
+      get_key (&q);
+      get_name (&q);
+      get_key (&q);
+      get_key (&q);
+      jump_to ref = get_to (&q);
+      int len = get_int (&q);
+      add_back (ref.unit, ref.include, ref.point,
+		jump_from (ref.loc, len, ref.expanded_id),
+		&overlay, get_to (&q));
+    }
 
-  cur_id = data.unit_map.get (args);
-  cur = unit (&log, input);
+  st->files[i].clear ();
+  overlay.save (&st->files[i], st->level);
+  st->states[i].clear ();
+  save_state (&st->states[i], st->level, st->batch_jumps[i],
+	      &st->batch_backs[i]);
+  report (st, "build", 1, 0, false);
 }
 
-void
-set::save_current_unit ()
+// Move the records keyed by the unit from the sorter to recs
+static size_t
+take_records (record_sorter* sorter, std::string* head, bool* more,
+	      int unit, std::vector<std::string>* recs)
 {
-  if (dump)
+  size_t size = 0;
+  while (*more)
     {
-      fprintf (stderr, "unit %s:\n", data.unit_map.at (cur_id).c_str ());
-      cur.dump (stderr, 1);
+      const char* q = head->c_str ();
+      if (get_key (&q) != unit)
+	break;
+      size += sizeof *head + head->size ();
+      recs->push_back (std::string ());
+      recs->back ().swap (*head);
+      *more = sorter->next (head);
     }
-  cur.save (unit_path (db, cur_id));
-
-  std::map<int, std::set<int> >::iterator it;
-  std::vector<int> rm;
-  for (it = data.ld_units.begin (); it != data.ld_units.end (); ++ it)
-    if (it->second.find (cur_id) != it->second.end ())
-      rm.push_back (it->first);
-  std::vector<int>::iterator jt;
-  for (jt = rm.begin (); jt != rm.end (); ++ jt)
-    data.ld_units.erase (*jt);
+  return size;
 }
 
+// The names of the changed units are resolved again, with the
+// symbols of the other units from the last state. The symbols of
+// the other names are kept as they are.
 static void
-save_unit_fid (FILE* fp, const unit_fid& fid)
+relink_syms (link_state* st)
 {
-  save_int32 (fp, fid.unit);
-  save_int32 (fp, fid.fid);
+  for (size_t i = 0; i < st->fresh.size (); ++ i)
+    st->names.insert (st->fresh_names[i].begin (),
+		      st->fresh_names[i].end ());
+  std::vector<std::vector<std::string> > ().swap (st->fresh_names);
+
+  const set_data& data = st->set->data;
+  std::set<int>::const_iterator it;
+  for (it = st->changed.begin (); it != st->changed.end (); ++ it)
+    {
+      std::vector<std::string> recs;
+      load_state (data, sym_key (st->base, *it), *it, &recs, NULL);
+      std::vector<std::string>::const_iterator rt;
+      for (rt = recs.begin (); rt != recs.end (); ++ rt)
+	st->names.insert (rt->c_str ());
+    }
+
+  const std::set<int>& units = data.ld_units.at (st->base);
+  for (it = units.begin (); it != units.end (); ++ it)
+    {
+      if (st->changed.find (*it) != st->changed.end ())
+	continue;
+      std::vector<std::string> recs;
+      load_state (data, sym_key (st->base, *it), *it, &recs, NULL);
+      std::vector<std::string>::const_iterator rt;
+      for (rt = recs.begin (); rt != recs.end (); ++ rt)
+	{
+	  std::string name (rt->c_str ());
+	  if (st->names.find (name) != st->names.end ())
+	    st->syms[hash_string (name) % st->parts]->add (*rt);
+	}
+    }
 }
 
+// The file of the symbols of the unit in another link, shared if
+// the unit isn't rebuilt since
 static void
-load_unit_fid (FILE* fp, unit_fid* fid)
+find_syms (const set_data& data, int unit, pack_entry* ent)
 {
-  load_int32 (fp, &fid->unit);
-  load_int32 (fp, &fid->fid);
+  std::map<int, std::set<int> >::const_iterator it;
+  for (it = data.ld_units.begin (); it != data.ld_units.end (); ++ it)
+    {
+      std::map<int, std::set<int> >::const_iterator changed
+	= data.ld_changed.find (it->first);
+      std::map<std::pair<int, int>, pack_entry>::const_iterator file
+	= data.entries.find (sym_key (it->first, unit));
+      if (it->second.find (unit) != it->second.end ()
+	  && (changed == data.ld_changed.end ()
+	      || changed->second.find (unit) == changed->second.end ())
+	  && file != data.entries.end ())
+	{
+	  *ent = file->second;
+	  return;
+	}
+    }
 }
 
-void
-file_set::save (const std::string& path) const
+static void
+relink_records (link_state* st, const std::vector<std::string>& recs,
+		record_sorter* sorter)
 {
-  FILE* fp = fopen (path.c_str (), "wb");
-  assert (fp);
-
-  file_map.save (fp, save_string);
-
-  save_int32 (fp, files.size ());
-  std::map<unit_fid, int>::const_iterator file;
-  for (file = files.begin (); file != files.end (); ++ file)
+  std::string name;
+  std::vector<std::string>::const_iterator it;
+  for (it = recs.begin (); it != recs.end (); ++ it)
     {
-      save_unit_fid (fp, file->first);
-      save_int32 (fp, file->second);
+      int unit = record_unit (*it, &name);
+      if (st->names.find (name) != st->names.end ())
+	st->linked.insert (unit);
+      else
+	sorter->add (*it);
     }
+}
 
-  save_int32 (fp, file_units.size ());
-  std::map<int, std::set<unit_fid> >::const_iterator unit;
-  for (unit = file_units.begin (); unit != file_units.end (); ++ unit)
+// The jumps and the backs of the other names are kept, the units
+// with the names have their overlays built again
+static void
+relink_records (link_state* st)
+{
+  const set_data& data = st->set->data;
+  const std::set<int>& units = data.ld_units.at (st->base);
+  std::set<int>::const_iterator it;
+  for (it = units.begin (); it != units.end (); ++ it)
     {
-       save_int32 (fp, unit->first);
-       save_int32 (fp, unit->second.size ());
-       std::set<unit_fid>::const_iterator fid;
-       for (fid = unit->second.begin ();
-	    fid != unit->second.end ();
-	    ++ fid)
-	 save_unit_fid (fp, *fid);
+      std::vector<std::string> jumps, backs;
+      load_state (data, record_key (st->base, *it), *it, &jumps, &backs);
+      relink_records (st, jumps, st->jumps);
+      relink_records (st, backs, st->backs);
     }
+}
 
-  fclose (fp);
+// Whether the overlay of the unit at i of the batch is built
+static bool
+relinked (const link_state* st, int i)
+{
+  if (! st->relinking || st->linked.find (st->batch[i]) != st->linked.end ())
+    return true;
+
+  std::vector<std::string> recs (st->batch_jumps[i]);
+  recs.insert (recs.end (), st->batch_backs[i].begin (),
+	       st->batch_backs[i].end ());
+  std::vector<std::string>::const_iterator it;
+  for (it = recs.begin (); it != recs.end (); ++ it)
+    {
+      std::string name;
+      record_unit (*it, &name);
+      if (st->names.find (name) != st->names.end ())
+	return true;
+    }
+  return false;
 }
 
 void
-file_set::load (const std::string& path)
+set_usr::link (link_state* st, int ld,
+	       std::map<std::pair<int, int>, pack_entry>* entries)
 {
-  FILE* fp = fopen (path.c_str (), "rb");
-  assert (fp);
-
-  file_map.load (fp, load_string);
+  st->fresh_files.assign (st->fresh.size (), pack_entry ());
+  for (size_t i = 0; i < st->fresh.size (); ++ i)
+    find_syms (data, st->fresh[i], &st->fresh_files[i]);
+  run_parallel (read_syms, st, st->fresh.size ());
+  for (size_t i = 0; i < st->fresh.size (); ++ i)
+    if (st->fresh_files[i].size)
+      (*entries)[sym_key (ld, st->fresh[i])] = st->fresh_files[i];
+  if (st->relinking)
+    {
+      relink_syms (st);
+      relink_records (st);
+    }
 
-  int file_size;
-  load_int32 (fp, &file_size);
-  for (int i = 0; i < file_size; ++ i)
+  st->done = 0;
+  run_parallel (resolve_syms, st, st->parts);
+  report (st, "resolve", 0, 0, true);
+  for (int p = 0; p < st->parts; ++ p)
     {
-      unit_fid ufid;
-      load_unit_fid (fp, &ufid);
-      int fid;
-      load_int32 (fp, &fid);
-      files.insert (std::make_pair (ufid, fid));
+      delete st->syms[p];
+      st->syms[p] = NULL;
     }
 
-  int file_unit_size;
-  load_int32 (fp, &file_unit_size);
-  for (int i = 0; i < file_unit_size; ++ i)
+  // The edges of a batch of units at a time. A unit is only read
+  // by one thread.
+  st->done = 0;
+  std::string head;
+  bool more = st->edges->next (&head);
+  while (more)
     {
-      int fid;
-      load_int32 (fp, &fid);
-      int unit_size;
-      load_int32 (fp, &unit_size);
-      std::set<unit_fid> units;
-      for (int j = 0; j < unit_size; ++ j)
+      st->batch.clear ();
+      st->batch_jumps.clear ();
+      size_t size = 0;
+      while (more && size < st->budget)
 	{
-	  unit_fid ufid;
-	  load_unit_fid (fp, &ufid);
-	  units.insert (ufid);
+	  const char* q = head.c_str ();
+	  st->batch.push_back (get_key (&q));
+	  st->batch_jumps.push_back (std::vector<std::string> ());
+	  size += take_records (st->edges, &head, &more, st->batch.back (),
+				&st->batch_jumps.back ());
 	}
-      file_units.insert (std::make_pair (fid, units));
+      run_parallel (find_refs, st, st->batch.size ());
     }
-
-  fclose (fp);
+  report (st, "refer", 0, 0, true);
+  delete st->edges;
+  st->edges = NULL;
+
+  // The overlays of a batch of units at a time, appended in the
+  // order of the units
+  st->done = 0;
+  std::string jump, back;
+  bool more_jumps = st->jumps->next (&jump);
+  bool more_backs = st->backs->next (&back);
+  while (more_jumps || more_backs)
+    {
+      st->batch.clear ();
+      st->batch_jumps.clear ();
+      st->batch_backs.clear ();
+      size_t size = 0;
+      while ((more_jumps || more_backs) && size < st->budget)
+	{
+	  const char* q = jump.c_str ();
+	  const char* r = back.c_str ();
+	  int id = ! more_backs ? get_key (&q)
+		     : ! more_jumps ? get_key (&r)
+		     : std::min (get_key (&q), get_key (&r));
+	  st->batch.push_back (id);
+	  st->batch_jumps.push_back (std::vector<std::string> ());
+	  st->batch_backs.push_back (std::vector<std::string> ());
+	  size_t taken = take_records (st->jumps, &jump, &more_jumps, id,
+				       &st->batch_jumps.back ());
+	  taken += take_records (st->backs, &back, &more_backs, id,
+				 &st->batch_backs.back ());
+	  if (! relinked (st, st->batch.size () - 1))
+	    {
+	      st->batch.pop_back ();
+	      st->batch_jumps.pop_back ();
+	      st->batch_backs.pop_back ();
+	      continue;
+	    }
+	  size += taken;
+	  st->linked.insert (id);
+	}
+      if (st->batch.empty ())
+	continue;
+
+      st->files.resize (st->batch.size ());
+      st->states.resize (st->batch.size ());
+      run_parallel (build_overlay, st, st->batch.size ());
+
+      pack_writer pack (db);
+      if (! st->pack)
+	st->pack = pack.ino;
+      // Repacked while linking
+      else if (pack.ino != st->pack)
+	return;
+      for (size_t i = 0; i < st->batch.size (); ++ i)
+	{
+	  (*entries)[std::make_pair (ld, st->batch[i])]
+	    = pack.append (st->files[i]);
+	  (*entries)[record_key (ld, st->batch[i])]
+	    = pack.append (st->states[i]);
+	}
+    }
+  report (st, "build", 0, 0, true);
 }
 
-set_usr::set_usr (const std::string& db)
-  : db (db)
+// Keep the file of the last link at from as the one at to, unless
+// it's built again
+static void
+keep_entry (const set_data& data, const std::pair<int, int>& from,
+	    const std::pair<int, int>& to,
+	    std::map<std::pair<int, int>, pack_entry>* entries)
 {
-  data.load (index_path (db));
+  std::map<std::pair<int, int>, pack_entry>::const_iterator ent;
+  if ((ent = data.entries.find (from)) != data.entries.end ()
+      && entries->find (to) == entries->end ())
+    (*entries)[to] = ent->second;
 }
 
-void
-set_usr::build_files (int ld)
+// A hash of the unit ids, to find the lds of the same units
+static uint64_t
+units_digest (const std::set<int>& units)
 {
-  assert (ld_files.find (ld) == ld_files.end ());
-  ld_files.insert (std::make_pair (ld, file_set ()));
-  file_set* fset = &ld_files.find (ld)->second;
-
-  assert (data.ld_units.find (ld) != data.ld_units.end ());
-  const std::set<int>* units = &data.ld_units.find (ld)->second;
+  uint64_t h = 14695981039346656037ULL;
   std::set<int>::const_iterator it;
-  for (it = units->begin (); it != units->end (); ++ it)
+  for (it = units.begin (); it != units.end (); ++ it)
+    for (int s = 0; s < 32; s += 8)
+      h = (h ^ (uint8_t) (*it >> s)) * 1099511628211ULL;
+  return h;
+}
+
+// The linked ld with its state kept, whose units are the closest to
+// units, and the units changed from it. 0 if linking all the units
+// is about as cheap.
+static int
+closest_ld (const set_data& data, int ld, const std::set<int>& units,
+	    std::set<int>* changed)
+{
+  // Another ld of the same units, by the digests first
+  uint64_t digest = units_digest (units);
+  std::map<int, uint64_t>::const_iterator dt;
+  for (dt = data.ld_digests.begin (); dt != data.ld_digests.end (); ++ dt)
+    if (dt->second == digest && dt->first != ld
+	&& data.ld_changed.find (dt->first) == data.ld_changed.end ()
+	&& data.entries.find (std::make_pair (dt->first, -1))
+	   != data.entries.end ()
+	&& data.ld_units.at (dt->first) == units)
+      {
+	changed->clear ();
+	return dt->first;
+      }
+
+  int base = 0;
+  std::map<int, std::set<int> >::const_iterator it;
+  for (it = data.ld_units.begin (); it != data.ld_units.end (); ++ it)
     {
-      const unit* unit = get (*it);
-      std::map<int, std::set<int> >::const_iterator jt;
-      for (jt = unit->file_includes.begin ();
-	   jt != unit->file_includes.end (); ++ jt)
+      if (data.entries.find (std::make_pair (it->first, -1))
+	  == data.entries.end ())
+	continue;
+
+      std::set<int> diff;
+      if (data.ld_changed.find (it->first) != data.ld_changed.end ())
+	diff = data.ld_changed.find (it->first)->second;
+      std::set_symmetric_difference (it->second.begin (), it->second.end (),
+				     units.begin (), units.end (),
+				     std::inserter (diff, diff.end ()));
+      if (diff.size () * 2 >= units.size ())
+	continue;
+      // The ld itself on ties
+      if (! base || diff.size () < changed->size ()
+	  || (diff.size () == changed->size () && it->first == ld))
 	{
-	  int fid = jt->first;
-	  const std::string file = unit->file_map.at (fid);
-	  char* full = realpath (file.c_str(), NULL);
-	  if (! full)
-	    continue;
-
-	  int set_fid = fset->file_map.get (std::string (full));
-	  free (full);
-
-	  unit_fid ufid (*it, fid);
-	  fset->files.insert (std::make_pair (ufid, set_fid));
-	  if (fset->file_units.find (set_fid) == fset->file_units.end ())
-	    fset->file_units.insert (std::make_pair (set_fid,
-						     std::set<unit_fid> ()));
-	  fset->file_units.find (set_fid)->second.insert (ufid);
+	  base = it->first;
+	  changed->swap (diff);
 	}
     }
-
-  fset->save (files_path (db, ld));
+  return base;
 }
 
-static void
-add_jump_src (std::map<std::string, std::vector<std::pair<int, jump_src> > >* srcs,
-              const std::string name, int unit, const std::vector<jump_src>& src)
+bool
+read_stamp (const char* file, ld_stamp* stamp)
 {
-  if (srcs->find (name) == srcs->end ())
-    srcs->insert (std::make_pair (name,
-				  std::vector<std::pair<int, jump_src> > ()));
-
-  std::vector<jump_src>::const_iterator it;
-  for (it = src.begin (); it != src.end (); ++ it)
-    srcs->find (name)->second.push_back (std::make_pair (unit, *it));
+  struct stat st;
+  if (stat (file, &st) != 0)
+    return false;
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtim.tv_sec;
+  stamp->mtime_nsec = st.st_mtim.tv_nsec;
+  return true;
 }
 
-static void
-add_jump_src (std::map<std::string, std::vector<std::pair<int, jump_src> > >* srcs,
-              const std::string name, int unit, const jump_src& src)
+int
+set_usr::find_ld (const char* name, const ld_stamp& stamp,
+		  std::set<int>* units)
 {
-  if (srcs->find (name) == srcs->end ())
-    srcs->insert (std::make_pair (name,
-				  std::vector<std::pair<int, jump_src> > ()));
+  char* full = realpath (name, NULL);
+  if (! full)
+    return 0;
+  int id = ((const id_map<std::string>&) data.ld_map).get (full);
+  free (full);
 
-  srcs->find (name)->second.push_back (std::make_pair (unit, src));
+  if (id == 0
+      || data.ld_stamps.find (id) == data.ld_stamps.end ()
+      || ! (data.ld_stamps.find (id)->second == stamp))
+    return 0;
+  *units = data.ld_units.at (id);
+  return id;
 }
 
 int
-set_usr::get_ld (const char* name, const std::set<int>& units)
+set_usr::get_ld (const char* name)
 {
   char* full = realpath (name, NULL);
   if (! full)
     return 0;
-  int id = data.ld_map.get (std::string (full));
+  std::string path (full);
   free (full);
-  if (data.ld_units.find (id) == data.ld_units.end ())
+
+  int id = ((const id_map<std::string>&) data.ld_map).get (path);
+  if (id == 0)
     {
-      std::map<std::string, std::vector<std::pair<int, jump_src> > > srcs;
-      std::map<std::string, jump_tgt> tgts;
+      set_lock lock (db, &data);
+      id = data.ld_map.get (path);
+    }
+  return id;
+}
+
+int
+set_usr::get_ld (const char* name, const std::set<int>& units,
+		 const ld_stamp* stamp)
+{
+  int id = get_ld (name);
+  if (id == 0)
+    return 0;
 
-      // TODO this is really slow
+  if (check_ld (id) && data.ld_units.find (id)->second == units)
+    {
+      // The binary is rewritten with the same units
+      if (stamp && (data.ld_stamps.find (id) == data.ld_stamps.end ()
+		    || ! (data.ld_stamps.find (id)->second == *stamp)))
+	{
+	  set_lock lock (db, &data);
+	  if (data.ld_units.find (id) != data.ld_units.end ()
+	      && data.ld_units.find (id)->second == units)
+	    data.ld_stamps[id] = *stamp;
+	}
+    }
+  else
+    {
+      // The units as linked, to tell if any is rebuilt meanwhile
+      std::vector<pack_entry> sources;
       std::set<int>::const_iterator it;
       for (it = units.begin (); it != units.end (); ++ it)
+	sources.push_back (data.entries.at (std::make_pair (0, *it)));
+
+      std::set<int> changed;
+      int base = closest_ld (data, id, units, &changed);
+      ino_t ino = 0;
+      struct stat ps;
+      if (data.pack != -1 && fstat (data.pack, &ps) == 0)
+	ino = ps.st_ino;
+
+      // The files kept or shared are in the pack loaded, linking
+      // appends to it only
+      link_state st (this, units);
+      st.pack = ino;
+      std::map<std::pair<int, int>, pack_entry> entries;
+      bool same = base && changed.empty ();
+      if (same)
 	{
-	  const unit* unit = get (*it);
-	  std::map<std::string, std::vector<jump_src> >::const_iterator jt;
-	  for (jt = unit->pub_srcs.begin ();
-	       jt != unit->pub_srcs.end (); ++ jt)
-	    add_jump_src (&srcs, jt->first, *it, jt->second);
-
-	  std::map<std::string, jump_tgt>::const_iterator lt;
-	  for (lt = unit->pub_tgts.begin ();
-	       lt != unit->pub_tgts.end (); ++ lt)
-	    {
-	      if (tgts.find (lt->first) == tgts.end ())
-		tgts.insert (std::make_pair (lt->first,
-					     lt->second));
-	      else if (tgts.find (lt->first)->second.weak
-		       && ! lt->second.weak)
-		tgts.find (lt->first)->second = lt->second;
-              else if (tgts.find (lt->first)->second.init)
-                add_jump_src (&srcs, lt->first, *it,
-                              jump_src (lt->second.to.include,
-                                        jump_from (lt->second.to.loc,
-                                                   lt->first.length (),
-                                                   lt->second.to.expanded_id)));
-              else
-                {
-                  const jump_to& old_to = tgts.find (lt->first)->second.to;
-                  add_jump_src (&srcs, lt->first, old_to.unit,
-                                jump_src (old_to.include,
-                                          jump_from (old_to.loc,
-                                                     lt->first.length (),
-                                                     old_to.expanded_id)));
-                  tgts.find (lt->first)->second = lt->second;
-                }
-	    }
+	  std::map<std::pair<int, int>, pack_entry>::const_iterator ent;
+	  for (ent = data.entries.lower_bound (std::make_pair (base, INT_MIN));
+	       ent != data.entries.lower_bound (std::make_pair (base + 1,
+								INT_MIN));
+	       ++ ent)
+	    entries[std::make_pair (id, ent->first.second)] = ent->second;
 	}
-
-      std::map<int, unit> ld_units;
-      std::map<std::string,
-	       std::vector<std::pair<int, jump_src> > >::iterator mt;
-      for (mt = srcs.begin (); mt != srcs.end (); ++ mt)
+      else
 	{
-	  if (tgts.find (mt->first) == tgts.end ())
-	    continue;
+	  if (base)
+	    st.relink (base, data.entries.at (std::make_pair (base, -1)),
+		       changed);
+	  link (&st, id, &entries);
+	}
 
-	  const gcj::jump_to& to = tgts.find (mt->first)->second.to;
-	  std::vector<std::pair<int, jump_src> >::iterator nt;
-	  for (nt = mt->second.begin (); nt != mt->second.end (); ++ nt)
+      // The overlays of the other units, the file set and the state
+      // go after the linked ones, indexed before unlocking the pack
+      pack_writer pack (db);
+      // Repacked while linking, leave it to be relinked. The files
+      // are only appended to the pack loaded, which the repack
+      // dropped with them.
+      if (st.pack && pack.ino != st.pack)
+	return id;
+      if (! same)
+	{
+	  std::string empty;
+	  unit ().save (&empty, st.level);
+	  for (it = units.begin (); it != units.end (); ++ it)
 	    {
-	      int unit_id = nt->first;
-	      if (ld_units.find (unit_id) == ld_units.end ())
-		ld_units.insert (std::make_pair (unit_id, unit ()));
-
-	      unit* from_unit = &ld_units.find (unit_id)->second;
-	      context* ctx = from_unit->get (nt->second.include);
-	      // Cross link the declarations to the definitions
-	      ctx->add (nt->second.from, to);
-
-	      if (ld_units.find (to.unit) == ld_units.end ())
-		ld_units.insert (std::make_pair (to.unit, unit ()));
-
-              // add_back (unit_id, nt->second.include, 0, nt->second.from,
-              //           &ld_units.find (to.unit)->second, to);
-	      add_back2 (get (unit_id)->get (nt->second.include),
-			 nt->second.from,
-			 &ld_units.find (to.unit)->second, to);
+	      if (st.relinking && st.changed.find (*it) == st.changed.end ())
+		keep_entry (data, sym_key (base, *it), sym_key (id, *it),
+			    &entries);
+	      std::pair<int, int> key (id, *it);
+	      if (st.relinking && st.linked.find (*it) == st.linked.end ())
+		{
+		  keep_entry (data, std::make_pair (base, *it), key, &entries);
+		  keep_entry (data, record_key (base, *it),
+			      record_key (id, *it), &entries);
+		}
+	      if (entries.find (key) == entries.end ())
+		entries[key] = pack.append (empty);
 	    }
-	}
 
-      std::map<int, unit>::iterator ot;
-      for (ot = ld_units.begin (); ot != ld_units.end (); ++ ot)
-	ot->second.save (unit_path (db, id, ot->first));
-
-      // Create an empty file for those have no linkage data
-      std::set<int>::const_iterator pt;
-      for (pt = units.begin (); pt != units.end (); ++ pt)
-        if (ld_units.find (*pt) == ld_units.end ())
-          unit ().save (unit_path (db, id, *pt));
+	  build_files (id, units, st.level, base,
+		       st.relinking ? &st.changed : NULL, &pack, &entries);
+	  std::string state;
+	  put_int (&state, st.level);
+	  entries[std::make_pair (id, -1)] = pack.append (state);
+	}
 
-      data.ld_units.insert (std::make_pair (id, units));
-      build_files (id);
-      data.save (index_path (db));
+      set_lock lock (db, &data);
+      // Units rebuilt while linking, leave it to be relinked. The
+      // files appended are left unindexed, the next repack drops
+      // them.
+      std::vector<pack_entry>::const_iterator src = sources.begin ();
+      for (it = units.begin (); it != units.end (); ++ it, ++ src)
+	if (data.entries.at (std::make_pair (0, *it)).offset != src->offset)
+	  return id;
+
+      data.entries.erase (data.entries.lower_bound (std::make_pair (id,
+								    INT_MIN)),
+			  data.entries.lower_bound (std::make_pair (id + 1,
+								    INT_MIN)));
+      data.entries.insert (entries.begin (), entries.end ());
+      data.ld_units[id] = units;
+      data.ld_changed.erase (id);
+      data.ld_digests[id] = units_digest (units);
+      if (stamp)
+	data.ld_stamps[id] = *stamp;
+      else
+	data.ld_stamps.erase (id);
+      ld_units.erase (id);
+      ld_files.erase (id);
     }
-  else
-    assert (data.ld_units.find (id)->second == units);
   return id;
 }
 
 const unit*
 set_usr::get (int id)
 {
-  if (id == 0 || id > data.unit_map.size ())
+  // A hole if the record of the unit was torn
+  if (id == 0 || id > data.unit_map.size ()
+      || data.entries.find (std::make_pair (0, id)) == data.entries.end ())
     return NULL;
 
   if (units.find (id) == units.end ())
     {
       units.insert (std::make_pair (id, unit (NULL)));
-      units.find (id)->second.load (unit_path (db, id));
+      units.find (id)->second.load (data.pack,
+				    data.entries.at (std::make_pair (0, id)));
     }
 
   return &units.find (id)->second;
 }
 
+const unit*
+set_usr::peek (int id, unit* tmp)
+{
+  if (units.find (id) != units.end ())
+    return &units.find (id)->second;
+
+  tmp->load (data.pack, data.entries.at (std::make_pair (0, id)));
+  return tmp;
+}
+
 bool
 set_usr::check_ld (int ld)
 {
   return ld != 0
 	 && ld <= data.ld_map.size()
-	 // This is possible if it's erased by rebuilding unit,
-	 // if so, rebuild it by calling get_ld with unit set
-	 && data.ld_units.find (ld) != data.ld_units.end ();
+	 // This is possible if a unit is rebuilt, if so, relink it
+	 // by calling get_ld with unit set
+	 && data.ld_units.find (ld) != data.ld_units.end ()
+	 && data.ld_changed.find (ld) == data.ld_changed.end ();
 }
 
 const unit*
@@ -1206,7 +3993,8 @@ set_usr::get (int ld, int id)
       == ld_units.find (ld)->second.end ())
     {
       ld_units.find (ld)->second.insert (std::make_pair (id, unit (NULL)));
-      ld_units.find (ld)->second.find (id)->second.load (unit_path (db, ld, id));
+      ld_units.find (ld)->second.find (id)->second.load (
+	data.pack, data.entries.at (std::make_pair (ld, id)));
     }
 
   return &ld_units.find (ld)->second.find (id)->second;
@@ -1220,9 +4008,96 @@ set_usr::get_file_set (int ld)
   if (ld_files.find (ld) == ld_files.end ())
     {
       ld_files.insert (std::make_pair (ld, file_set ()));
-      ld_files.find (ld)->second.load (files_path (db, ld));
+      ld_files.find (ld)->second.load (data.pack,
+				       data.entries.at (std::make_pair (ld, 0)));
     }
   return &ld_files.find (ld)->second;
 }
 
+// The files shared by lds are copied once, copied maps their
+// offsets in the old pack to the new entries
+static void
+copy_entry (FILE* fp, int pack, const pack_entry& ent,
+	    std::map<std::pair<int, int>, pack_entry>* entries,
+	    const std::pair<int, int>& key,
+	    std::map<uint64_t, pack_entry>* copied)
+{
+  if (entries->find (key) != entries->end ())
+    return;
+  if (copied->find (ent.offset) != copied->end ())
+    {
+      entries->insert (std::make_pair (key, copied->at (ent.offset)));
+      return;
+    }
+
+  std::vector<char> buf (ent.size);
+  assert (pread (pack, &buf[0], ent.size, ent.offset)
+	  == (ssize_t) ent.size);
+
+  uint64_t offset = ftell (fp);
+  for (; offset % 8; ++ offset)
+    assert (fputc (0, fp) == 0);
+  assert (fwrite (&buf[0], 1, ent.size, fp) == ent.size);
+
+  pack_entry copy = { offset, ent.size };
+  entries->insert (std::make_pair (key, copy));
+  copied->insert (std::make_pair (ent.offset, copy));
+}
+
+void
+set_usr::repack ()
+{
+  // Lock the pack before the index, as appending does
+  pack_writer pack (db);
+  set_lock lock (db, &data);
+
+  std::string path = pack_path (db);
+  std::string tmp;
+  FILE* fp = open_save (path, &tmp);
+
+  std::map<std::pair<int, int>, pack_entry> entries;
+  std::map<uint64_t, pack_entry> copied;
+  std::map<std::pair<int, int>, pack_entry>::const_iterator ent;
+  std::map<int, std::set<int> >::const_iterator ld;
+  for (ld = data.ld_units.begin (); ld != data.ld_units.end (); ++ ld)
+    {
+      // Each unit then its overlay and its state, then the file set
+      // and the level of the link
+      std::set<int>::const_iterator it;
+      for (it = ld->second.begin (); it != ld->second.end (); ++ it)
+	{
+	  std::pair<int, int> key (0, *it);
+	  if ((ent = data.entries.find (key)) != data.entries.end ())
+	    copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+	  key = std::make_pair (ld->first, *it);
+	  if ((ent = data.entries.find (key)) != data.entries.end ())
+	    copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+	  key = sym_key (ld->first, *it);
+	  if ((ent = data.entries.find (key)) != data.entries.end ())
+	    copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+	  key = record_key (ld->first, *it);
+	  if ((ent = data.entries.find (key)) != data.entries.end ())
+	    copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+	}
+      std::pair<int, int> key (ld->first, 0);
+      if ((ent = data.entries.find (key)) != data.entries.end ())
+	copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+      key = std::make_pair (ld->first, -1);
+      if ((ent = data.entries.find (key)) != data.entries.end ())
+	copy_entry (fp, data.pack, ent->second, &entries, key, &copied);
+    }
+
+  // Units not linked yet
+  for (ent = data.entries.begin (); ent != data.entries.end (); ++ ent)
+    if (ent->first.first == 0)
+      copy_entry (fp, data.pack, ent->second, &entries, ent->first,
+		  &copied);
+
+  close_save (fp, path, tmp);
+  data.entries.swap (entries);
+  // The pack was created by locking it
+  close (data.pack);
+  data.open_pack (db);
+}
+
 }
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <string>
 #include <map>
@@ -54,35 +55,68 @@ load_int32 (FILE* fp, int* v)
   *v = t;
 }
 
+inline uint32_t
+hash_value (uint32_t v)
+{
+  v ^= v >> 16;
+  v *= 0x85ebca6b;
+  v ^= v >> 13;
+  v *= 0xc2b2ae35;
+  v ^= v >> 16;
+  return v;
+}
+
+inline uint32_t
+hash_value (int v)
+{
+  return hash_value ((uint32_t) v);
+}
+
+inline uint32_t
+hash_value (const std::string& str)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < str.size (); ++ i)
+    h = (h ^ (unsigned char) str[i]) * 16777619u;
+  return h;
+}
+
+inline uint32_t
+hash_combine (uint32_t h, int v)
+{
+  return hash_value (h * 31 + (uint32_t) v);
+}
+
+// Keys are interned to ids counting from 1. The keys are stored
+// contiguously by id and looked up through an open addressing
+// table of ids. References returned by at are invalidated by
+// interning a new key.
 template <typename type>
 class id_map
 {
 public:
   id_map ()
-    : cur (0)
-  {
-  }
-  id_map (const id_map& map)
-    : cur (map.cur), map (map.map), vec (map.vec)
+    : cur (0), slots (8, 0)
   {
   }
 
   int
   get (const type& key) const
   {
-    return map.find (key) == map.end ()
-	   ? 0 : map.find (key)->second;
+    return slots[probe (key)];
   }
 
   int
   get (const type& key)
   {
-    if (map.find (key) == map.end ())
-    {
-      map.insert (std::make_pair (key, ++ cur));
-      vec.push_back (&map.find (key)->first);
-    }
-    return map.find (key)->second;
+    size_t slot = probe (key);
+    if (slots[slot])
+      return slots[slot];
+
+    keys.push_back (key);
+    slots[slot] = ++ cur;
+    grow ();
+    return cur;
   }
 
   int
@@ -91,47 +125,105 @@ public:
     return cur;
   }
 
+  void
+  clear ()
+  {
+    cur = 0;
+    keys.clear ();
+    slots.assign (8, 0);
+  }
+
+  // Bind key to a given id, used when ids are handed out by
+  // someone else and may arrive out of order. Skipped ids are
+  // left as holes of default constructed keys.
+  void
+  set (int id, const type& key)
+  {
+    size_t slot = probe (key);
+    assert (id > 0 && slots[slot] == 0);
+    if ((int) keys.size () < id)
+      keys.resize (id);
+    assert (keys[id - 1] == type ());
+    keys[id - 1] = key;
+    slots[slot] = id;
+    if (cur < id)
+      cur = id;
+    grow ();
+  }
+
   bool
   contains (int id) const
   {
-    return (int) vec.size () >= id;
+    return id > 0 && (int) keys.size () >= id && ! (keys[id - 1] == type ());
   }
 
   const type&
   at (int id) const
   {
-    assert ((int) vec.size () >= id);
-    return *vec.at (id - 1);
+    assert (contains (id));
+    return keys[id - 1];
   }
 
+  template <typename stream>
   void
-  save (FILE* fp, void (* sv)(FILE*, const type&)) const
+  save (stream* fp, void (* sv)(stream*, const type&)) const
   {
     save_int32 (fp, cur);
-    typename std::vector<const type*>::const_iterator it;
-    for (it = vec.begin (); it != vec.end (); ++ it)
-      sv (fp, **it);
+    typename std::vector<type>::const_iterator it;
+    for (it = keys.begin (); it != keys.end (); ++ it)
+      sv (fp, *it);
   }
 
+  template <typename stream>
   void
-  load (FILE* fp, void (* ld)(FILE*, type*))
+  load (stream* fp, void (* ld)(stream*, type*))
   {
     assert (cur == 0);
 
     load_int32 (fp, &cur);
+    keys.resize (cur);
+    size_t size = 8;
+    while (size < (size_t) cur * 2)
+      size *= 2;
+    slots.assign (size, 0);
+
     for (int i = 1; i <= cur; ++ i)
       {
-	type v;
-	ld (fp, &v);
-	map.insert (std::make_pair (v, i));
-	vec.push_back (&map.find (v)->first);
+	ld (fp, &keys[i - 1]);
+	if (! (keys[i - 1] == type ()))
+	  slots[probe (keys[i - 1])] = i;
       }
   }
 
 private:
+  // The slot of the key, or the empty slot to insert it
+  size_t
+  probe (const type& key) const
+  {
+    size_t mask = slots.size () - 1;
+    size_t slot = hash_value (key) & mask;
+    while (slots[slot] && ! (keys[slots[slot] - 1] == key))
+      slot = (slot + 1) & mask;
+    return slot;
+  }
+
+  // Keep the load factor under a half
+  void
+  grow ()
+  {
+    if ((size_t) cur * 2 <= slots.size ())
+      return;
+
+    slots.assign (slots.size () * 2, 0);
+    for (int i = 1; i <= (int) keys.size (); ++ i)
+      if (! (keys[i - 1] == type ()))
+	slots[probe (keys[i - 1])] = i;
+  }
+
   int cur;
-  std::map<type, int> map;
-  std::vector<const type*> vec;
+  std::vector<type> keys;
+  // id of the key in the slot, 0 if empty
+  std::vector<int> slots;
 };
 
 struct unit;
@@ -176,63 +268,68 @@ struct file_location
   int col;
 };
 
-struct source_location
-{
-  source_location ()
-    : fid (0)
-  {
-  }
-
-  source_location (const source_location& loc)
-    : fid (loc.fid), loc (loc.loc)
-  {
-  }
+struct macro_stack;
 
-  source_location (int fid)
-    : fid (fid)
+// An include stack, hash-consed as the file plus the stack of the
+// file including it, so stacks share their parents and intern in
+// constant time. For example, file C included at line 3 of B
+// which is included at line 5 of the main file A:
+//   1: { A, 0,0, 0 }
+//   2: { B, 5,0, 1 }
+//   3: { C, 3,0, 2 }
+struct source_stack
+{
+  source_stack ()
+    : fid (0), parent (0)
   {
   }
 
-  source_location (int fid, const file_location& loc)
-    : fid (fid), loc (loc)
+  source_stack (const source_stack& stack)
+    : fid (stack.fid), loc (stack.loc), parent (stack.parent)
   {
   }
 
-  bool
-  operator< (const source_location& rhs) const
+  source_stack (int fid)
+    : fid (fid), parent (0)
   {
-    return fid < rhs.fid
-	   || (! (rhs.fid < fid) && loc < rhs.loc);
   }
 
-  int fid;
-  file_location loc;
-};
-
-struct macro_stack;
-
-struct source_stack
-{
-  source_stack ()
+  source_stack (int fid, const file_location& loc, int parent)
+    : fid (fid), loc (loc), parent (parent)
   {
   }
 
   bool
   operator< (const source_stack& rhs) const
   {
-    return locs < rhs.locs;
+    if (fid != rhs.fid) return fid < rhs.fid;
+    if (parent != rhs.parent) return parent < rhs.parent;
+    return loc < rhs.loc;
   }
 
-  void
-  add (const source_location& loc)
+  bool
+  operator== (const source_stack& rhs) const
   {
-    locs.push_back (loc);
+    return fid == rhs.fid && parent == rhs.parent && loc == rhs.loc;
   }
 
-  // Front included from back
-  std::vector<source_location> locs;
+  int fid;
+  // Where it's included in the parent
+  file_location loc;
+  int parent;
 };
 
+inline uint32_t
+hash_value (const source_stack& stack)
+{
+  uint32_t h = hash_value (stack.fid);
+  h = hash_combine (h, stack.loc.line);
+  h = hash_combine (h, stack.loc.col);
+  return hash_combine (h, stack.parent);
+}
+
+// The point in the include stack where a macro is expanded, the
+// file is the one of the include stack
 struct expansion_point
 {
   expansion_point ()
@@ -246,7 +343,7 @@ struct expansion_point
   }
 
   expansion_point (int include,
-		   const source_location& loc)
+		   const file_location& loc)
     : include (include), loc (loc)
   {
   }
@@ -258,10 +355,24 @@ struct expansion_point
 	   || (! (rhs.include < include) && loc < rhs.loc);
   }
 
+  bool
+  operator== (const expansion_point& rhs) const
+  {
+    return include == rhs.include && loc == rhs.loc;
+  }
+
   int include;
-  source_location loc;
+  file_location loc;
 };
 
+inline uint32_t
+hash_value (const expansion_point& point)
+{
+  uint32_t h = hash_value (point.include);
+  h = hash_combine (h, point.loc.line);
+  return hash_combine (h, point.loc.col);
+}
+
 struct macro_stack
 {
   void
@@ -309,9 +420,14 @@ struct jump_from
   {
   }
 
+  // The tokens in the source code sort before the tokens expanded
+  // from macros, so a location in the middle of a token finds the
+  // token right before it among the former
   bool
   operator< (const jump_from& rhs) const
   {
+    if ((expanded_id != 0) != (rhs.expanded_id != 0))
+      return expanded_id == 0;
     return loc < rhs.loc
 	   || (! (rhs.loc < loc)
 	       && expanded_id < rhs.expanded_id);
@@ -322,6 +438,49 @@ struct jump_from
   int expanded_id;
 };
 
+// Frozen jump_from keys in the same order, with the line and
+// column packed into one integer for searching
+struct jump_keys
+{
+  jump_keys ()
+    : plain (0)
+  {
+  }
+
+  jump_keys (const jump_keys& keys)
+    : locs (keys.locs), lens (keys.lens),
+      expanded_ids (keys.expanded_ids), plain (keys.plain)
+  {
+  }
+
+  static uint64_t
+  pack (const file_location& loc)
+  {
+    return (uint64_t) (uint32_t) loc.line << 32 | (uint32_t) loc.col;
+  }
+
+  int
+  size () const
+  {
+    return locs.size ();
+  }
+
+  file_location
+  loc (int i) const
+  {
+    return file_location (locs[i] >> 32, (uint32_t) locs[i]);
+  }
+
+  // The key covering the location, -1 if none
+  int find (const file_location& loc, int expanded_id) const;
+
+  std::vector<uint64_t> locs;
+  std::vector<int32_t> lens;
+  std::vector<int32_t> expanded_ids;
+  // The number of the keys with expanded_id 0, which come first
+  int plain;
+};
+
 struct expanded_token
 {
   expanded_token ()
@@ -426,7 +585,7 @@ struct jump_to
     if (point != rhs.point) return point < rhs.point;
     if (loc != rhs.loc) return loc < rhs.loc;
     if (expanded_id != rhs.expanded_id) return expanded_id < rhs.expanded_id;
-    if (exp != rhs.expanded_id) return expanded_id < rhs.expanded_id;
+    if (exp != rhs.exp) return exp < rhs.exp;
     return false;
   }
 
@@ -464,13 +623,89 @@ struct jump_to
   int exp;
 };
 
+// A reference whose backward jump is added later in a batch
+struct back_edge
+{
+  back_edge (int unit, int include, int point,
+	     const jump_from& from, const jump_to& to)
+    : unit (unit), include (include), point (point),
+      from (from), to (to)
+  {
+  }
+
+  int unit;
+  int include;
+  int point;
+  jump_from from;
+  jump_to to;
+};
+
 void add_back (int, int, int, const jump_from&, unit*, const jump_to&);
 void add_back2 (const context*, const jump_from&, unit*, const jump_to&);
+void add_backs (std::vector<back_edge>*, unit*);
+
+struct unit_file;
+
+// The jumps or backs of a frozen context, encoded in the unit file
+// and decoded when first searched. The backs of keys[i] are tos
+// from offsets[i] to offsets[i + 1].
+struct jump_table
+{
+  jump_table ()
+    : file (NULL), section (0), offset (0), size (0), decoded (false)
+  {
+  }
+
+  jump_table (const jump_table& table)
+    : file (table.file), section (table.section),
+      offset (table.offset), size (table.size),
+      decoded (table.decoded),
+      keys (table.keys), offsets (table.offsets), tos (table.tos)
+  {
+  }
+
+  void decode (bool backs);
+
+  const unit_file* file;
+  int section;
+  int offset;
+  int size;
+  bool decoded;
+  jump_keys keys;
+  std::vector<int32_t> offsets;
+  std::vector<jump_to> tos;
+};
+
+// The sorted backward jumps of a location
+struct jump_backs
+{
+  jump_backs ()
+    : first (NULL), last (NULL)
+  {
+  }
 
+  jump_backs (const jump_to* first, const jump_to* last)
+    : first (first), last (last)
+  {
+  }
+
+  bool
+  empty () const
+  {
+    return first == last;
+  }
+
+  const jump_to* first;
+  const jump_to* last;
+};
+
+// A context is built in the maps, and loaded frozen as sorted
+// arrays in the mapped unit file. Frozen contexts can't be modified
+// or saved.
 struct context
 {
   context ()
-    : surrounding (0)
+    : surrounding (0), frozen (false), outer (NULL)
   {
   }
 
@@ -478,20 +713,22 @@ struct context
     : jumps (ctx.jumps),
       backs (ctx.backs),
       surrounding (ctx.surrounding),
-      expansion_contexts (ctx.expansion_contexts)
+      expansion_contexts (ctx.expansion_contexts),
+      frozen (ctx.frozen),
+      outer (ctx.outer),
+      frozen_jumps (ctx.frozen_jumps),
+      frozen_backs (ctx.frozen_backs),
+      expansion_ids (ctx.expansion_ids),
+      expansion_list (ctx.expansion_list)
   {
   }
 
-  const context*
-  expansion (int point) const
-  {
-    return expansion_contexts.find (point) == expansion_contexts.end ()
-	   ? NULL : &expansion_contexts.find (point)->second;
-  }
+  const context* expansion (int point) const;
 
   context*
   expansion (int include, int point)
   {
+    assert (! frozen);
     std::pair<std::map<int, context>::iterator, bool> pair;
     pair = expansion_contexts.insert (std::make_pair (point, context ()));
     if (pair.second)
@@ -499,9 +736,13 @@ struct context
     return &pair.first->second;
   }
 
+  // Point => expansion context of all expansion contexts
+  void expansions (std::vector<std::pair<int, const context*> >*) const;
+
   void
   add (const jump_from& from, const jump_to& to)
   {
+    assert (! frozen);
     //assert (jumps.insert (std::make_pair (from, to)).second);
     if (jumps.find (from) == jumps.end ())
       jumps.insert (std::make_pair (from, to));
@@ -512,13 +753,7 @@ struct context
       }
   }
 
-  void
-  back (const jump_from& from, const jump_to& to)
-  {
-    if (backs.find (from) == backs.end ())
-      backs.insert (std::make_pair (from, std::set<jump_to>()));
-    backs.find(from)->second.insert(to);
-  }
+  void back (const jump_from& from, const jump_to& to);
 
   const jump_to* jump (const unit*, const file_location&, int,
 		       file_location*) const;
@@ -531,21 +766,34 @@ struct context
 						     NULL);
   }
 
-  const std::set<jump_to>* jump_back (const file_location& loc,
-				      int expanded_id) const;
+  jump_backs jump_back (const file_location& loc, int expanded_id) const;
 
   void dump (FILE*, int, const unit*) const;
-  void save (FILE*) const;
-  void load (FILE*);
+  // Resolve outer once the unit is loaded
+  void resolve (const unit*);
 
   // We maintain two direction jumps, forward and backward.
   // Forward jumps are from references to definitions, and
   // for a token we only have one definition.
   std::map<jump_from, jump_to> jumps;
-  std::map<jump_from, std::set<jump_to> > backs;
+  // The backs of a location are sorted and unique
+  std::map<jump_from, std::vector<jump_to> > backs;
   int surrounding;
 
   std::map<int, context> expansion_contexts;
+
+  // The frozen maps
+  bool frozen;
+  // The surrounding context
+  const context* outer;
+  mutable jump_table frozen_jumps;
+  mutable jump_table frozen_backs;
+  std::vector<int> expansion_ids;
+  std::vector<context> expansion_list;
+
+private:
+  const jump_to* find (const file_location&, int, file_location*) const;
+  const jump_table* table (jump_table*, bool) const;
 };
 
 struct jump_src
@@ -581,41 +829,159 @@ struct jump_tgt
   bool init;
 };
 
+// Canonical paths of file names, optionally persisted per
+// database so following compilations skip realpath on the files
+// seen before
+struct path_cache
+{
+  path_cache ()
+    : resolves (0)
+  {
+  }
+
+  void load (const std::string& db);
+  // Empty if the file can't be resolved
+  const std::string& get (const char* file);
+
+  std::string db;
+  std::string cwd;
+  // absolute file name => canonical path
+  std::map<std::string, std::string> paths;
+  // realpath calls of the current unit, reset by set::next
+  int resolves;
+};
+
+// Where a file is in db/pack
+struct pack_entry
+{
+  uint64_t offset;
+  uint64_t size;
+};
+
+// The binary file of an ld when its units were read, they are read
+// again only if it's changed
+struct ld_stamp
+{
+  bool
+  operator== (const ld_stamp& rhs) const
+  {
+    return dev == rhs.dev && ino == rhs.ino && size == rhs.size
+	   && mtime == rhs.mtime && mtime_nsec == rhs.mtime_nsec;
+  }
+
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+  int64_t mtime_nsec;
+};
+
+bool read_stamp (const char* file, ld_stamp* stamp);
+
+// A file mapped read only. Compressed files are split in blocks
+// compressed independently, each is decompressed when first read.
+struct mapped_file
+{
+  mapped_file ()
+    : map (NULL), map_size (0), begin (NULL), raw (NULL), size (0),
+      level (0), block_size (0)
+  {
+  }
+
+  ~mapped_file ();
+
+  // Map the file at the entry of the pack
+  void load (int pack, const pack_entry& ent);
+  const char* bytes (uint64_t offset, uint64_t size) const;
+  // The NUL terminated string at the offset
+  const char* string (uint64_t offset) const;
+
+  void* map;
+  size_t map_size;
+  // The file in the mapping
+  const char* begin;
+  // The decompressed contents, or NULL if the file isn't compressed
+  char* raw;
+  uint64_t size;
+  int level;
+  uint64_t block_size;
+  // The offsets of the blocks in the file and the end of the last
+  std::vector<uint64_t> blocks;
+  mutable std::vector<bool> inflated;
+};
+
+// Append the file compressed in the level, 0 to not compress it
+void encode_file (std::string* out, const std::string& data, int level);
+
+struct section_reader;
+
+// A unit file mapped read only, see unit::save for the layout
+struct unit_file
+{
+  void load (int pack, const pack_entry& ent);
+
+  template <typename type>
+  const type*
+  section (int id, int* count) const
+  {
+    *count = sections[id].second / sizeof (type);
+    return (const type*) data.bytes (sections[id].first,
+				     sections[id].second);
+  }
+
+  const char* bytes (int id, uint64_t offset, uint64_t size) const;
+  // The string at the offset of the string pool
+  const char* string (int offset) const;
+  section_reader reader (int id) const;
+  section_reader reader (int id, uint64_t offset, uint64_t size) const;
+
+  mapped_file data;
+  // Offset and size of each section
+  std::vector<std::pair<uint64_t, uint64_t> > sections;
+};
+
 struct unit
 {
+  // Only units not loaded from a file are copied
   unit (const unit& unit)
     : log (unit.log),
       input (unit.input), input_id (unit.input_id),
       contexts (unit.contexts),
       file_map (unit.file_map),
       include_map (unit.include_map),
-      point_map (unit.point_map)
+      point_map (unit.point_map),
+      file (NULL), tables (0),
+      paths (unit.paths)
   {
+    assert (! unit.file);
   }
 
   unit ()
-    : log (NULL), input_id (0)
+    : log (NULL), input_id (0), file (NULL), tables (0), paths (NULL)
   {
   }
 
   unit (logger* log)
-    : log (log), input_id (0)
+    : log (log), input_id (0), file (NULL), tables (0), paths (NULL)
   {
   }
 
-  unit (logger* log, const std::string& input)
+  unit (logger* log, const std::string& input, path_cache* paths)
     : log (log),
-      input (input), input_id (0)
+      input (input), input_id (0), file (NULL), tables (0),
+      paths (paths)
   {
   }
 
-  const context*
-  get (int include) const
+  ~unit ()
   {
-    return contexts.find (include) == contexts.end ()
-	   ? NULL : &contexts.find (include)->second;
+    delete file;
   }
 
+  // Contexts of loaded units are read when first asked for, with
+  // their expansion contexts
+  const context* get (int include) const;
+
   context*
   get (int include)
   {
@@ -645,12 +1011,8 @@ struct unit
     return id;
   }
 
-  const expansion*
-  get_expansion (int id) const
-  {
-    assert (id <= (int) expansions.size ());
-    return &expansions.find (id)->second;
-  }
+  // Expansions of loaded units are read when first asked for
+  const expansion* get_expansion (int id) const;
 
   expansion*
   get_expansion (int id)
@@ -662,6 +1024,15 @@ struct unit
 
   int include_id (const source_stack& include);
 
+  // Entries of the maps of loaded units are read when first asked
+  // for, the other tables are read whole
+  const std::string& get_file (int fid) const;
+  const source_stack& get_include (int include) const;
+  bool has_include (int include) const;
+  const std::map<int, std::set<int> >& get_file_includes () const;
+  const std::map<std::string, std::vector<jump_src> >& get_pub_srcs () const;
+  const std::map<std::string, jump_tgt>& get_pub_tgts () const;
+
   int
   point_id (const expansion_point& point)
   {
@@ -669,8 +1040,9 @@ struct unit
   }
 
   void dump (FILE*, int) const;
-  void save (const std::string& path) const;
-  void load (const std::string& path);
+  // Compressed in the level, 0 to not compress
+  void save (std::string* out, int level) const;
+  void load (int pack, const pack_entry& ent);
 
   void
   trace (const char* fmt, ...)
@@ -693,38 +1065,123 @@ struct unit
   logger* log;
   std::string input;
   int input_id;
-  std::map<int, context> contexts;
-  std::map<int, expansion> expansions;
-  id_map<std::string> file_map;
-  id_map<source_stack> include_map;
+  mutable std::map<int, context> contexts;
+  mutable std::map<int, expansion> expansions;
+  mutable id_map<std::string> file_map;
+  mutable id_map<source_stack> include_map;
+  // Only used while building, not read back
   id_map<expansion_point> point_map;
 
-  std::map<int, std::set<int> > file_includes;
+  mutable std::map<int, std::set<int> > file_includes;
 
-  std::map<std::string, std::vector<jump_src> > pub_srcs;
-  std::map<std::string, jump_tgt> pub_tgts;
+  mutable std::map<std::string, std::vector<jump_src> > pub_srcs;
+  mutable std::map<std::string, jump_tgt> pub_tgts;
+
+  // The file a loaded unit is mapped from, its contexts and
+  // expansions are read in place
+  unit_file* file;
+  // The unit_table read from the file
+  mutable int tables;
+
+  // Used while building, not saved. gcc keeps its file names
+  // through the compilation, so each distinct name pointer is
+  // resolved only once.
+  path_cache* paths;
+  std::map<const char*, int> file_ptrs;
+};
+
+enum unit_table
+{
+  UT_FILE_INCLUDES = 1,
+  UT_PUBS = 2
 };
 
 enum set_flag
 {
   SF_TRACE = 1,
-  SF_DUMP = 2
+  SF_DUMP = 2,
+  SF_PATHS = 4
 };
 
+// The files of units, ld overlays and file sets are appended to
+// db/pack, locked while appending. Repacking replaces the pack,
+// so appending reopens it if the locked one is unlinked.
+struct pack_writer
+{
+  pack_writer (const std::string& db);
+  ~pack_writer ();
+
+  pack_entry append (const std::string& data);
+  pack_entry append (FILE* fp);
+
+  int fd;
+  // Of the pack locked, changed by repacking
+  ino_t ino;
+};
+
+// The database index is db/index plus an append-only journal
+// db/journal. Compiling processes only append records to the
+// journal, readers replay it on top of the index and fold it
+// back into the index lazily.
 struct set_data
 {
+  set_data ()
+    : pack (-1)
+  {
+  }
+
+  ~set_data ()
+  {
+    clear ();
+  }
+
+  // Load the index and replay the journal, returns whether the
+  // journal has records not folded into the index yet
+  bool load (const std::string& db);
+  void clear ();
+
   void save (const std::string& path) const;
-  void load (const std::string& path);
+  void load_index (const std::string& path);
+  void replay (const std::string& journal);
+  void open_pack (const std::string& db);
 
   id_map<std::string> unit_map;
   id_map<std::string> ld_map;
   // ld_id => unit_id set
   std::map<int, std::set<int> > ld_units;
+  // ld_id => unit_id set rebuilt since linked, relinked on demand
+  std::map<int, std::set<int> > ld_changed;
+  // ld_id => digest of the unit_id set, to find the lds with the
+  // same units
+  std::map<int, uint64_t> ld_digests;
+  std::map<int, ld_stamp> ld_stamps;
+  // (ld_id, unit_id) => where the file is in the pack, ld_id is 0
+  // for units, unit_id is 0 for file sets, -1 for the levels of the
+  // links and -2 unit_id and -2 unit_id - 1 for the states of their
+  // units
+  std::map<std::pair<int, int>, pack_entry> entries;
+  // The pack the entries refer to, opened along with the index
+  // since repacking replaces both
+  int pack;
+
+};
+
+// Exclusively lock the database index, reload it and fold the
+// journal into it when unlocked. Mutations to the data between
+// are saved.
+struct set_lock
+{
+  set_lock (const std::string& db, set_data* data);
+  ~set_lock ();
+
+  std::string db;
+  set_data* data;
+  int fd;
 };
 
 struct set
 {
-  set (const char* db, int flags);
+  set (const char* db, int flags, int compress);
   ~set ();
 
   void next (const std::string& args, const std::string& input);
@@ -770,10 +1227,13 @@ struct set
   logger log;
   std::string db;
   bool dump;
+  // The compression level of the units
+  int compress;
 
-  set_data data;
+  path_cache paths;
 
   int cur_id;
+  std::string cur_args;
   unit cur;
 
   void* cur_data;
@@ -809,8 +1269,8 @@ struct unit_fid
 
 struct file_set
 {
-  void save (const std::string&) const;
-  void load (const std::string&);
+  void save (std::string* out, int level) const;
+  void load (int pack, const pack_entry& ent);
 
   id_map<std::string> file_map;
 
@@ -818,13 +1278,38 @@ struct file_set
   std::map<int, std::set<unit_fid> > file_units;
 };
 
+struct link_state;
+
 struct set_usr
 {
   set_usr (const std::string& db);
 
-  void build_files (int ld);
-  int get_ld (const char* name, const std::set<int>& units);
+  // Relinking if changed, the units changed since the link of base
+  void build_files (int ld, const std::set<int>& units, int level,
+		    int base, const std::set<int>* changed,
+		    pack_writer* pack,
+		    std::map<std::pair<int, int>, pack_entry>* entries);
+  // Link the units and append the overlays of the linked ones,
+  // see link_state
+  void link (link_state* st, int ld,
+	     std::map<std::pair<int, int>, pack_entry>* entries);
+  // Copy the live files to a new pack, the units of each ld next
+  // to each other
+  void repack ();
+  // The ld of the binary if it's not changed since its units were
+  // read, with the units, 0 otherwise
+  int find_ld (const char* name, const ld_stamp& stamp,
+	       std::set<int>* units);
+  // The ld of the binary, added if it's not, without linking it
+  int get_ld (const char* name);
+  // Link the units if they're changed, stamp is of the binary
+  // before reading the units from it
+  int get_ld (const char* name, const std::set<int>& units,
+	      const ld_stamp* stamp);
   const unit* get (int id);
+  // The unit if it's kept, or read into tmp, for passing over all
+  // the units of an ld without keeping them
+  const unit* peek (int id, unit* tmp);
   bool check_ld (int ld);
   const unit* get (int ld, int id);
   const file_set* get_file_set (int ld);
@@ -836,12 +1321,24 @@ struct set_usr
   std::map<int, std::map<int, unit> > ld_units;
   // ld_id => file set
   std::map<int, file_set> ld_files;
+
+  // Called with the phase of a link and the units or the symbols
+  // done of the total, 0 if it's not known, from any thread of the
+  // link
+  void (* progress) (void* arg, const char* phase,
+		     size_t done, size_t total);
+  void* progress_arg;
 };
 
 struct unwind_stack
 {
+  unwind_stack ()
+    : include (0)
+  {
+  }
+
   macro_stack macro;
-  source_stack include;
+  int include;
 };
 
 }
@@ -22,12 +22,41 @@ if s:bin == "" || s:data == ""
 endif
 
 call system("mkdir -p " . s:ctx)
-call system("mkdir -p " . simplify(s:db . "/files"))
+
+" The queries go to a server keeping the database loaded if vim has
+" jobs, s:status is the exit status of the command
+let s:server = ""
+function s:Server()
+  if !has("job")
+    return 0
+  endif
+  if type(s:server) != v:t_channel || ch_status(s:server) != "open"
+    let job = job_start([ s:bin, s:db, "serve" ],
+          \ { "mode": "json", "err_io": "null", "timeout": 600000 })
+    let s:server = job_getchannel(job)
+  endif
+  return ch_status(s:server) == "open"
+endfunction
 
 function s:Gcj(command)
   let cmd = s:bin . " " . s:db . " " . a:command
   echom cmd
-  return system(cmd . " 2> /dev/null")
+  if s:Server()
+    let resp = ch_evalexpr(s:server, split(a:command))
+    if type(resp) == v:t_list && len(resp) == 2
+      let [ s:status, out ] = resp
+      return out
+    endif
+    " Timed out or closed, restarted by the next query
+    let job = ch_getjob(s:server)
+    if type(job) == v:t_job && job_status(job) == "run"
+      call job_stop(job)
+    endif
+    let s:server = ""
+  endif
+  let out = system(cmd . " 2> /dev/null")
+  let s:status = v:shell_error
+  return out
 endfunction
 
 function s:FindWin(name, id)
@@ -431,6 +460,36 @@ function s:SelectUnit()
 
 endfunction
 
+" Linking in the background, jumps are in the units only until it's done
+let s:link_jobs = { }
+function s:LinkProgress(name, channel, msg)
+  let [ phase, done, total ] = split(a:msg)
+  if total != 0
+    let done = done . "/" . total
+  endif
+  echo "Gcj linking " . a:name . ": " . phase . " " . done
+endfunction
+
+function s:LinkExit(name, job, status)
+  call remove(s:link_jobs, a:name)
+  if a:status == 0
+    echom "Gcj linked " . a:name
+  else
+    echom "Gcj failed to link " . a:name
+  endif
+endfunction
+
+function s:Link(name)
+  if has_key(s:link_jobs, a:name)
+    return
+  endif
+  let cmd = [ s:bin, s:db, "link", "-p", a:name ]
+  let s:link_jobs[a:name] = job_start(cmd,
+        \ { "out_cb": function("s:LinkProgress", [ a:name ]),
+        \   "exit_cb": function("s:LinkExit", [ a:name ]),
+        \   "err_io": "null" })
+endfunction
+
 let s:obj_win_id = 0
 function s:SetObject(...)
 
@@ -439,11 +498,18 @@ function s:SetObject(...)
   elseif a:0 == 1
 
     let name = a:1
-    let units = eval(s:Gcj("list_elf " . name))
-    if v:shell_error == 1
+    if has("job")
+      let units = eval(s:Gcj("list_elf -n " . name))
+    else
+      let units = eval(s:Gcj("list_elf " . name))
+    endif
+    if s:status == 1
       echom "Invalid object file " . name
       return
     endif
+    if has("job")
+      call s:Link(name)
+    endif
 
   else
     echom "Invalid number of arguments"
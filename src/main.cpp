@@ -1,7 +1,15 @@
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include <algorithm>
 #include <map>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "gcj.hpp"
 #include "elf.hpp"
@@ -55,14 +63,17 @@ error_out:
   return false;
 }
 
+// The units of the elf, known ones if units, or all the units
 static bool
-list_elf (gcj::set_usr* set, const char* elf,
+list_elf (gcj::set_usr* set, const char* elf, const std::set<int>* units,
 	  std::map<std::string, int>* result)
 {
   if (elf)
     {
       std::set<int> unit_ids;
-      if (! read_elf (elf, &unit_ids))
+      if (units)
+	unit_ids = *units;
+      else if (! read_elf (elf, &unit_ids))
 	return false;
       std::set<int>::iterator it;
       for (it = unit_ids.begin (); it != unit_ids.end (); ++ it)
@@ -72,27 +83,67 @@ list_elf (gcj::set_usr* set, const char* elf,
   else
     {
       for (int id = 1; id <= set->data.unit_map.size (); ++ id)
-	result->insert (std::make_pair (set->data.unit_map.at (id), id));
+	if (set->data.unit_map.contains (id))
+	  result->insert (std::make_pair (set->data.unit_map.at (id), id));
     }
   return true;
 }
 
+// The ld of the elf, linked if link and it's not, and its units
+static int
+get_elf_ld (gcj::set_usr* set, const char* elf, bool link,
+	    list_elf_result* result)
+{
+  // The binary isn't read again if it's not changed since
+  gcj::ld_stamp stamp;
+  bool stamped = gcj::read_stamp (elf, &stamp);
+  std::set<int> known;
+  bool found = stamped && set->find_ld (elf, stamp, &known);
+
+  if (! list_elf (set, elf, found ? &known : NULL, result))
+    return 0;
+  if (! link)
+    return set->get_ld (elf);
+
+  std::set<int> units;
+  list_elf_result::iterator it;
+  for (it = result->begin (); it != result->end (); ++ it)
+    units.insert (it->second);
+  int ld = set->get_ld (elf, units, stamped ? &stamp : NULL);
+  if (ld == 0)
+    fprintf (stderr, "file not found %s\n", elf);
+  return ld;
+}
+
+// A line of the phase, the units or the symbols done and the total,
+// 0 if it's not known
+static void
+print_progress (void* arg, const char* phase, size_t done, size_t total)
+{
+  printf ("%s %zu %zu\n", phase, done, total);
+  fflush (stdout);
+}
+
 struct select_unit_result
 {
   int include;
   std::string file;
 };
 
+// 0 if the unit or the include isn't there
 static int
 get_fid (const gcj::unit* unit, int include)
 {
-  return unit->include_map.at (include).locs.front ().fid;
+  if (! unit || ! unit->has_include (include))
+    return 0;
+  return unit->get_include (include).fid;
 }
 
 static std::string
 get_file (const gcj::unit* unit, int include)
 {
-  return unit->file_map.at (get_fid (unit, include));
+  int fid = get_fid (unit, include);
+  return fid ? unit->get_file (fid) : std::string ();
 }
 
 static void
@@ -125,6 +176,7 @@ expand (gcj::set_usr* set,
   const gcj::context* ctx;
   ctx = point == 0
 	? u->get (include) : u->get (include, point);
+  if (! ctx) return;
 
   const gcj::jump_to* to;
   gcj::file_location begin;
@@ -193,13 +245,9 @@ context_refer (const gcj::context* ctx,
 	       const gcj::file_location& loc, int exp,
 	       std::vector<jump_result>* results)
 {
-  const std::set<gcj::jump_to>* backs;
-  backs = ctx->jump_back (loc, exp);
-  if (! backs) return;
-
-  std::set<gcj::jump_to>::const_iterator it;
-  for (it = backs->begin (); it != backs->end (); ++ it)
-    results->push_back (jump_result (&(*it),
+  gcj::jump_backs backs = ctx->jump_back (loc, exp);
+  for (const gcj::jump_to* it = backs.first; it != backs.last; ++ it)
+    results->push_back (jump_result (it,
 				     get_file (set->get (it->unit),
 					       it->include)));
 }
@@ -226,11 +274,10 @@ unit_refer (const gcj::unit* unit,
 
       context_refer (ctx, set, loc, exp, results);
 
-      std::map<int, gcj::context>::const_iterator jt;
-      for (jt = ctx->expansion_contexts.begin ();
-	   jt != ctx->expansion_contexts.end ();
-	   ++jt)
-	context_refer (&jt->second, set, loc, exp, results);
+      std::vector<std::pair<int, const gcj::context*> > exps;
+      ctx->expansions (&exps);
+      for (size_t i = 0; i < exps.size (); ++ i)
+	context_refer (exps[i].second, set, loc, exp, results);
     }
 }
 
@@ -241,6 +288,7 @@ refer (gcj::set_usr* set,
 {
   const gcj::unit* pos_unit = set->get (unit);
   int pos_fid = get_fid (pos_unit, include);
+  if (pos_fid == 0) return;
 
   gcj::unit_fid ufid (unit, pos_fid);
 
@@ -264,87 +312,81 @@ refer (gcj::set_usr* set,
   for (it = unit_fids.begin (); it != unit_fids.end (); ++ it)
     {
       const gcj::unit* base = set->get (it->unit);
-      unit_refer (base, &base->file_includes,
+      if (! base) continue;
+      unit_refer (base, &base->get_file_includes (),
 		  set, it->fid, line, col, exp,
 		  results);
-      unit_refer (set->get (ld, it->unit), &base->file_includes,
+      unit_refer (set->get (ld, it->unit), &base->get_file_includes (),
 		  set, it->fid, line, col, exp,
 		  results);
     }
 }
 
 static void
-print_vim_context (int unit, int include, int point)
+print_vim_context (FILE* out, int unit, int include, int point)
 {
-  printf ("{ \"unit\": %d, \"include\": %d, \"point\": %d }",
-	  unit, include, point);
+  fprintf (out, "{ \"unit\": %d, \"include\": %d, \"point\": %d }",
+	   unit, include, point);
 }
 
 static void
-print_vim_position (int line, int col)
+print_vim_position (FILE* out, int line, int col)
 {
-  printf ("{ \"line\": %d, \"col\": %d }", line, col);
+  fprintf (out, "{ \"line\": %d, \"col\": %d }", line, col);
 }
 
 static void
-print_vim_position (int line, int col, int expid)
+print_vim_position (FILE* out, int line, int col, int expid)
 {
-  printf ("{ \"line\": %d, \"col\": %d, \"expid\": %d }",
-	  line, col, expid);
+  fprintf (out, "{ \"line\": %d, \"col\": %d, \"expid\": %d }",
+	   line, col, expid);
 }
 
 static void
-print_vim_jump_result (const jump_result& result)
+print_vim_jump_result (FILE* out, const jump_result& result)
 {
-  printf ("[ \"%s\", ",
-	  escape (result.file.c_str (), '"').c_str ());
-  print_vim_context (result.to->unit, result.to->include,
+  fprintf (out, "[ \"%s\", ",
+	   escape (result.file.c_str (), '"').c_str ());
+  print_vim_context (out, result.to->unit, result.to->include,
 		     result.to->point);
-  printf (", ");
-  print_vim_position (result.to->loc.line,
+  fprintf (out, ", ");
+  print_vim_position (out, result.to->loc.line,
 		      result.to->loc.col,
 		      result.to->expanded_id);
-  printf (" ]");
+  fprintf (out, " ]");
 }
 
+// Run the command on the set, printing the result to out
 static int
-command (const char* db, const char* cmd,
-	 int argc, const char* argv[])
+command (gcj::set_usr* set, const char* cmd,
+	 int argc, const char* argv[], FILE* out)
 {
-  gcj::set_usr set (db);
   if (strcmp (cmd, "list_elf") == 0)
     {
+      // Not linked with -n, the queries use the units only until
+      // it's linked
+      bool link = argc == 0 || strcmp (argv[0], "-n") != 0;
+      if (! link)
+	-- argc, ++ argv;
       if (argc > 1)
 	return usage ();
 
       list_elf_result result;
-      if (! list_elf (&set, argc == 0 ? NULL : argv[0], &result))
-	return 1;
-
       int ld = 0;
-      if (argc != 0)
-	{
-	  std::set<int> units;
-	  list_elf_result::iterator it;
-	  for (it = result.begin (); it != result.end (); ++ it)
-	    units.insert (it->second);
-	  ld = set.get_ld (argv[0], units);
-	  if (ld == 0)
-	    {
-	      fprintf (stderr, "file not found %s\n", argv[0]);
-	      return 1;
-	    }
-	}
+      if (argc == 0)
+	list_elf (set, NULL, NULL, &result);
+      else if ((ld = get_elf_ld (set, argv[0], link, &result)) == 0)
+	return 1;
 
-      printf ("[ %d, [ ", ld);
+      fprintf (out, "[ %d, [ ", ld);
       list_elf_result::iterator it;
       for (it = result.begin (); it != result.end (); ++ it)
 	{
-	  if (it != result.begin ()) printf (", ");
-	  printf ("[ \"%s\", %d ]",
-		  escape (it->first.c_str (), '"').c_str (), it->second);
+	  if (it != result.begin ()) fprintf (out, ", ");
+	  fprintf (out, "[ \"%s\", %d ]",
+		   escape (it->first.c_str (), '"').c_str (), it->second);
 	}
-      printf (" ] ]");
+      fprintf (out, " ] ]");
       return 0;
     }
   else if (strcmp (cmd, "select_unit") == 0)
@@ -353,15 +395,15 @@ command (const char* db, const char* cmd,
       if (argc != 1 || ! to_int (argv[0], &unit))
 	return usage ();
       select_unit_result result;
-      select_unit (&set, unit, &result);
+      select_unit (set, unit, &result);
       if (result.include)
 	{
 	  fprintf (stderr, "selected: %d %s\n",
 		   result.include, result.file.c_str ());
-	  printf ("[ \"%s\", ",
-		  escape (result.file.c_str (), '"').c_str ());
-	  print_vim_context (unit, result.include, 0);
-	  printf (" ]");
+	  fprintf (out, "[ \"%s\", ",
+		   escape (result.file.c_str (), '"').c_str ());
+	  print_vim_context (out, unit, result.include, 0);
+	  fprintf (out, " ]");
 	}
       else
 	fprintf (stderr, "none\n");
@@ -380,14 +422,14 @@ command (const char* db, const char* cmd,
 	return usage ();
 
       expand_result result;
-      expand (&set, unit, include, point, line, col,
+      expand (set, unit, include, point, line, col,
 	      &result);
 
       if (result.expansion)
 	{
-	  printf ("[ ");
-	  print_vim_position (result.loc.line, result.loc.col);
-	  printf (", [ ");
+	  fprintf (out, "[ ");
+	  print_vim_position (out, result.loc.line, result.loc.col);
+	  fprintf (out, ", [ ");
 	  std::vector<gcj::expanded_token>::const_iterator it;
 	  for (it = result.expansion->tokens.begin ();
 	       it != result.expansion->tokens.end ();
@@ -397,12 +439,12 @@ command (const char* db, const char* cmd,
 		       it->id, it->token.c_str ());
 
 	      if (it != result.expansion->tokens.begin ())
-		printf (", ");
-	      printf ("[ \"%s\", %d ]",
-		      escape (it->token.c_str (), '"').c_str (),
-		      it->id);
+		fprintf (out, ", ");
+	      fprintf (out, "[ \"%s\", %d ]",
+		       escape (it->token.c_str (), '"').c_str (),
+		       it->id);
 	    }
-	  printf ("] ]");
+	  fprintf (out, "] ]");
 	}
       else
 	fprintf (stderr, "none\n");
@@ -423,7 +465,7 @@ command (const char* db, const char* cmd,
 	return usage ();
 
       jump_result result;
-      jump (&set, ld, unit, include, point, line, col, exp,
+      jump (set, ld, unit, include, point, line, col, exp,
 	    &result);
       if (result.to)
 	{
@@ -433,7 +475,7 @@ command (const char* db, const char* cmd,
 		   result.to->expanded_id,
 		   result.file.c_str ());
 
-	  print_vim_jump_result (result);
+	  print_vim_jump_result (out, result);
 	}
       else
 	fprintf (stderr, "none\n");
@@ -453,9 +495,9 @@ command (const char* db, const char* cmd,
 	return usage ();
 
       std::vector<jump_result> results;
-      refer (&set, ld, unit, include, line, col, exp, &results);
+      refer (set, ld, unit, include, line, col, exp, &results);
       std::vector<jump_result>::iterator it;
-      printf ("[ ");
+      fprintf (out, "[ ");
       for (it = results.begin (); it != results.end (); ++ it)
 	{
 	  fprintf (stderr, "refered by: %d %d %d %d %d %s\n",
@@ -464,17 +506,427 @@ command (const char* db, const char* cmd,
 		   it->to->expanded_id,
 		   it->file.c_str ());
 
-	  if (it != results.begin ()) printf (", ");
-	  print_vim_jump_result (*it);
+	  if (it != results.begin ()) fprintf (out, ", ");
+	  print_vim_jump_result (out, *it);
 	}
-      printf (" ]");
+      fprintf (out, " ]");
 
+      return 0;
+    }
+  else if (strcmp (cmd, "link") == 0)
+    {
+      // Print the progress with -p
+      if (argc != 0 && strcmp (argv[0], "-p") == 0)
+	{
+	  set->progress = print_progress;
+	  -- argc, ++ argv;
+	}
+      if (argc == 0)
+	return usage ();
+
+      // Link the binaries ahead of browsing them
+      for (int i = 0; i < argc; ++ i)
+	{
+	  list_elf_result result;
+	  if (get_elf_ld (set, argv[i], true, &result) == 0)
+	    return 1;
+	}
+      return 0;
+    }
+  else if (strcmp (cmd, "repack") == 0)
+    {
+      if (argc != 0)
+	return usage ();
+
+      set->repack ();
       return 0;
     }
   else
     return 1;
 }
 
+// A server answers the commands with the set kept loaded, it's
+// loaded again once the index or the journal is changed
+struct server
+{
+  const char* db;
+  gcj::set_usr* set;
+  gcj::ld_stamp index;
+  uint64_t journal;
+};
+
+static void
+read_db_stamp (const char* db, gcj::ld_stamp* index, uint64_t* journal)
+{
+  memset (index, 0, sizeof *index);
+  gcj::read_stamp ((std::string (db) + "/index").c_str (), index);
+  gcj::ld_stamp stamp;
+  *journal = gcj::read_stamp ((std::string (db) + "/journal").c_str (),
+			      &stamp) ? stamp.size : 0;
+}
+
+static gcj::set_usr*
+server_set (server* srv)
+{
+  gcj::ld_stamp index;
+  uint64_t journal;
+  read_db_stamp (srv->db, &index, &journal);
+  if (! srv->set || ! (index == srv->index) || journal != srv->journal)
+    {
+      delete srv->set;
+      srv->index = index;
+      srv->journal = journal;
+      srv->set = new gcj::set_usr (srv->db);
+    }
+  return srv->set;
+}
+
+static void
+skip_space (const char** p)
+{
+  while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+    ++ *p;
+}
+
+static bool
+parse_string (const char** p, std::string* str)
+{
+  if (*(*p) ++ != '"')
+    return false;
+  for (; **p != '"'; ++ *p)
+    {
+      if (**p == '\0')
+	return false;
+      if (**p != '\\')
+	{
+	  *str += **p;
+	  continue;
+	}
+      switch (*++ *p)
+	{
+	case 'n': *str += '\n'; break;
+	case 't': *str += '\t'; break;
+	case 'r': *str += '\r'; break;
+	case '"': case '\\': case '/': *str += **p; break;
+	default: return false;
+	}
+    }
+  ++ *p;
+  return true;
+}
+
+// A request of the json channel of vim, [ id, [ command, args... ] ]
+static bool
+parse_request (const char* p, long* id, std::vector<std::string>* args)
+{
+  char* end;
+  *id = 0;
+  skip_space (&p);
+  if (*p ++ != '[')
+    return false;
+  *id = strtol (p, &end, 10);
+  p = end;
+  skip_space (&p);
+  if (*p ++ != ',')
+    return false;
+  skip_space (&p);
+  if (*p ++ != '[')
+    return false;
+  skip_space (&p);
+  while (*p != ']')
+    {
+      args->push_back (std::string ());
+      if (! parse_string (&p, &args->back ()))
+	return false;
+      skip_space (&p);
+      if (*p == ',')
+	++ p;
+      skip_space (&p);
+    }
+  return ! args->empty ();
+}
+
+// The response, [ id, [ status, output ] ]
+static void
+print_response (std::string* out, long id, int status,
+		const std::string& result)
+{
+  char buf[64];
+  snprintf (buf, sizeof buf, "[%ld,[%d,\"", id, status);
+  *out += buf;
+  for (size_t i = 0; i < result.size (); ++ i)
+    {
+      unsigned char c = result[i];
+      if (c == '"' || c == '\\')
+	*out += '\\';
+      if (c < 0x20)
+	{
+	  snprintf (buf, sizeof buf, "\\u%04x", c);
+	  *out += buf;
+	}
+      else
+	*out += c;
+    }
+  *out += "\"]]\n";
+}
+
+// Run the command of args[0] with the rest, only the queries as
+// they print nothing but the result
+static int
+query (gcj::set_usr* set, const std::vector<std::string>& args,
+       std::string* result)
+{
+  const char* cmd = args[0].c_str ();
+  if (strcmp (cmd, "link") == 0 || strcmp (cmd, "repack") == 0
+      || strcmp (cmd, "serve") == 0 || strcmp (cmd, "batch") == 0)
+    return usage ();
+
+  std::vector<const char*> argv;
+  for (size_t i = 1; i < args.size (); ++ i)
+    argv.push_back (args[i].c_str ());
+  argv.push_back (NULL);
+
+  char* buf;
+  size_t len;
+  FILE* mem = open_memstream (&buf, &len);
+  assert (mem);
+  int status = command (set, cmd, args.size () - 1, &argv[0], mem);
+  assert (fclose (mem) == 0);
+  result->assign (buf, len);
+  free (buf);
+  return status;
+}
+
+// The response to a line of request, an error with the id if it
+// can't be parsed, or 0 if the id neither
+static void
+serve_line (server* srv, const char* line, std::string* out)
+{
+  long id;
+  std::vector<std::string> args;
+  if (! parse_request (line, &id, &args))
+    {
+      print_response (out, id, 1, std::string ());
+      return;
+    }
+
+  // Linking holds the other clients, it's left to the link command
+  if (args[0] == "list_elf" && (args.size () == 1 || args[1] != "-n"))
+    args.insert (args.begin () + 1, "-n");
+
+  std::string result;
+  int status = query (server_set (srv), args, &result);
+  print_response (out, id, status, result);
+}
+
+static void
+write_all (int fd, const std::string& out)
+{
+  for (size_t done = 0; done < out.size (); )
+    {
+      ssize_t n = write (fd, out.c_str () + done, out.size () - done);
+      // The client is closed once its end is read
+      if (n <= 0)
+	return;
+      done += n;
+    }
+}
+
+// Serve stdin and stdout, or the connections to the unix socket,
+// a request of any client at a time
+static int
+serve (const char* db, int argc, const char* argv[])
+{
+  if (argc > 1)
+    return usage ();
+
+  server srv = { db, NULL, gcj::ld_stamp (), 0 };
+  if (argc == 0)
+    {
+      char* line = NULL;
+      size_t size = 0;
+      while (getline (&line, &size, stdin) != -1)
+	{
+	  std::string out;
+	  serve_line (&srv, line, &out);
+	  fputs (out.c_str (), stdout);
+	  fflush (stdout);
+	}
+      free (line);
+      delete srv.set;
+      return 0;
+    }
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (argv[0]) >= sizeof addr.sun_path)
+    return usage ();
+  strcpy (addr.sun_path, argv[0]);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  assert (fd != -1);
+  unlink (argv[0]);
+  if (bind (fd, (struct sockaddr*) &addr, sizeof addr) != 0
+      || listen (fd, 8) != 0)
+    {
+      fprintf (stderr, "failed to listen on %s\n", argv[0]);
+      close (fd);
+      return 1;
+    }
+
+  // A client gone leaves only its connection
+  signal (SIGPIPE, SIG_IGN);
+  // The socket then the clients, with the requests read partly
+  std::vector<struct pollfd> fds (1);
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  std::vector<std::string> bufs (1);
+  while (true)
+    {
+      if (poll (&fds[0], fds.size (), -1) < 0)
+	continue;
+
+      for (size_t i = fds.size () - 1; i > 0; -- i)
+	{
+	  if (! fds[i].revents)
+	    continue;
+	  char tmp[65536];
+	  ssize_t n = read (fds[i].fd, tmp, sizeof tmp);
+	  if (n <= 0)
+	    {
+	      close (fds[i].fd);
+	      fds.erase (fds.begin () + i);
+	      bufs.erase (bufs.begin () + i);
+	      continue;
+	    }
+
+	  bufs[i].append (tmp, n);
+	  size_t pos;
+	  while ((pos = bufs[i].find ('\n')) != std::string::npos)
+	    {
+	      std::string out;
+	      serve_line (&srv, bufs[i].substr (0, pos).c_str (), &out);
+	      bufs[i].erase (0, pos + 1);
+	      write_all (fds[i].fd, out);
+	    }
+	}
+
+      if (fds[0].revents & POLLIN)
+	{
+	  int conn = accept (fd, NULL, NULL);
+	  if (conn == -1)
+	    continue;
+	  struct pollfd pfd = { conn, POLLIN, 0 };
+	  fds.push_back (pfd);
+	  bufs.push_back (std::string ());
+	}
+    }
+}
+
+// The lines available on fd, up to max, waiting only if there are
+// none. False at the end.
+static bool
+read_lines (int fd, std::string* buf, bool* eof, size_t max,
+	    std::vector<std::string>* lines)
+{
+  while (true)
+    {
+      size_t pos;
+      while (lines->size () < max
+	     && (pos = buf->find ('\n')) != std::string::npos)
+	{
+	  lines->push_back (buf->substr (0, pos));
+	  buf->erase (0, pos + 1);
+	}
+      if (*eof && ! buf->empty () && lines->size () < max)
+	{
+	  lines->push_back (*buf);
+	  buf->clear ();
+	}
+      if (lines->size () == max || *eof)
+	return ! lines->empty ();
+
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (! lines->empty () && poll (&pfd, 1, 0) == 0)
+	return true;
+
+      char tmp[65536];
+      ssize_t n = read (fd, tmp, sizeof tmp);
+      if (n <= 0)
+	*eof = true;
+      else
+	buf->append (tmp, n);
+    }
+}
+
+// The unit a query is on, the queries are run in the order of the
+// units
+static int
+query_unit (const std::vector<std::string>& args)
+{
+  int unit = 0;
+  size_t i = args[0] == "select_unit" || args[0] == "expand" ? 1
+	     : args[0] == "jump" || args[0] == "refer" ? 2 : 0;
+  if (i && i < args.size ())
+    to_int (args[i].c_str (), &unit);
+  return unit;
+}
+
+// Run the commands of stdin, a line each as the arguments after db,
+// and print the exit status and the result of each, a line each in
+// the same order. The lines
+// read together are run in the order of their units, the units
+// loaded are dropped when a unit is done if there are too many.
+static int
+batch (const char* db, int argc, const char* argv[])
+{
+  if (argc != 0)
+    return usage ();
+
+  server srv = { db, NULL, gcj::ld_stamp (), 0 };
+  std::string buf;
+  bool eof = false;
+  std::vector<std::string> lines;
+  while (read_lines (0, &buf, &eof, 4096, &lines))
+    {
+      std::vector<std::vector<std::string> > queries (lines.size ());
+      std::vector<std::pair<int, size_t> > order;
+      for (size_t i = 0; i < lines.size (); ++ i)
+	{
+	  std::istringstream in (lines[i]);
+	  std::string arg;
+	  while (in >> arg)
+	    queries[i].push_back (arg);
+	  if (! queries[i].empty ())
+	    order.push_back (std::make_pair (query_unit (queries[i]), i));
+	}
+      std::sort (order.begin (), order.end ());
+
+      gcj::set_usr* set = server_set (&srv);
+      std::vector<std::string> results (lines.size ());
+      std::vector<int> status (lines.size (), 1);
+      for (size_t k = 0; k < order.size (); ++ k)
+	{
+	  size_t i = order[k].second;
+	  status[i] = query (set, queries[i], &results[i]);
+	  if ((k + 1 == order.size () || order[k + 1].first != order[k].first)
+	      && set->units.size () > 256)
+	    {
+	      set->units.clear ();
+	      set->ld_units.clear ();
+	    }
+	}
+
+      for (size_t i = 0; i < results.size (); ++ i)
+	printf ("%d %s\n", status[i], results[i].c_str ());
+      fflush (stdout);
+      lines.clear ();
+    }
+  delete srv.set;
+  return 0;
+}
+
 int
 main (int argc, const char* argv[])
 {
@@ -490,5 +942,11 @@ main (int argc, const char* argv[])
   int cmd_argc = argc - 3;
   const char** cmd_argv = argv + 3;
 
-  return command (db, cmd, cmd_argc, cmd_argv);
+  if (strcmp (cmd, "serve") == 0)
+    return serve (db, cmd_argc, cmd_argv);
+  if (strcmp (cmd, "batch") == 0)
+    return batch (db, cmd_argc, cmd_argv);
+
+  gcj::set_usr set (db);
+  return command (&set, cmd, cmd_argc, cmd_argv, stdout);
 }
@@ -3,6 +3,7 @@
 #include <stdarg.h>
 
 #include <string>
+#include <unordered_map>
 
 #include "gcc-plugin.h"
 #include "plugin-version.h"
@@ -24,6 +25,17 @@ struct plug_data
 {
   gcj::id_map<source_location> exp_map;
 
+  // Tokens from the same line map share the include stack, and
+  // those unwound to the same location share the expansion points
+  // from it on. Tokens of a macro argument in the same map may be
+  // unwound into different maps.
+  std::unordered_map<const line_map_ordinary*, int> includes;
+  std::unordered_map<source_location, gcj::macro_stack> macros;
+
+  // References whose backward jumps are added at the end of the
+  // unit in one pass
+  std::vector<gcj::back_edge> backs;
+
   std::map<std::string, std::vector<gcj::jump_src> > srcs;
   std::map<std::string, gcj::jump_tgt> tgts;
 
@@ -38,21 +50,6 @@ build_file_location (source_location l)
   return gcj::file_location (LOCATION_LINE (l), LOCATION_COLUMN (l));
 }
 
-static gcj::source_location
-build_source_location (gcj::unit* unit, source_location l)
-{
-  return gcj::source_location (unit->file_id (LOCATION_FILE (l)),
-			       build_file_location (l));
-}
-
-static gcj::source_location
-build_source_location (gcj::unit* unit, const line_map_ordinary* m)
-{
-  return gcj::source_location (unit->file_id (LINEMAP_FILE (m)),
-			       gcj::file_location (LAST_SOURCE_LINE (m),
-						   0));
-}
-
 static void
 cb_start_unit (void*, void* data)
 {
@@ -145,8 +142,14 @@ cb_finish_unit (void*, void* data)
 {
   gcj::set* set = (gcj::set*) data;
   plug_data* plug = (plug_data*) set->cur_data;
+  set->trace ("file names: %d, realpath: %d\n",
+	      (int) set->current ()->file_ptrs.size (),
+	      set->paths.resolves);
+  // Link after adding the backs, add_back2 reads them
+  add_backs (&plug->backs, set->current ());
   internal_link (set->current (), set->current_id (), plug);
   resolve_tags (set, plug);
+  add_backs (&plug->backs, set->current ());
   delete plug;
   set->cur_data = NULL;
 
@@ -170,66 +173,94 @@ cb_finish_unit (void*, void* data)
     }
 }
 
-static void
-unwind_include (gcj::unit* unit, source_location loc,
-		gcj::source_stack* stack, const char* prefix)
+static int
+include_id (gcj::set* set, const line_map_ordinary* m, const char* prefix)
 {
-  assert (loc != UNKNOWN_LOCATION);
+  gcj::unit* unit = set->current ();
+  plug_data* plug = (plug_data*) set->cur_data;
+
+  if (plug->includes.find (m) != plug->includes.end ())
+    return plug->includes.find (m)->second;
+
+  gcj::source_stack stack (unit->file_id (LINEMAP_FILE (m)));
+  if (! MAIN_FILE_P (m))
+    {
+      const line_map_ordinary* from = INCLUDED_FROM (line_table, m);
+      set->trace ("  %s, included from %s:%d\n",
+		  prefix,
+		  LINEMAP_FILE (from), LAST_SOURCE_LINE (from));
+
+      stack.loc = gcj::file_location (LAST_SOURCE_LINE (from), 0);
+      stack.parent = include_id (set, from, prefix);
+    }
+
+  int include = unit->include_id (stack);
+  plug->includes.insert (std::make_pair (m, include));
+  return include;
+}
 
-  int fid = unit->file_id (LOCATION_FILE (loc));
-  stack->add (gcj::source_location (fid));
+static int
+unwind_include (gcj::set* set, source_location loc, const char* prefix)
+{
+  assert (loc != UNKNOWN_LOCATION);
 
   const line_map_ordinary* m;
   linemap_resolve_location (line_table, loc,
 			    LRK_MACRO_EXPANSION_POINT, &m);
+  if (m)
+    return include_id (set, m, prefix);
 
-  while (m && ! MAIN_FILE_P (m))
-    {
-      m = INCLUDED_FROM (line_table, m);
-      unit->trace ("  %s, included from %s:%d\n",
-		   prefix,
-		   LINEMAP_FILE (m), LAST_SOURCE_LINE (m));
-
-      stack->add (build_source_location (unit, m));
-    }
+  gcj::unit* unit = set->current ();
+  return unit->include_id (
+	   gcj::source_stack (unit->file_id (LOCATION_FILE (loc))));
 }
 
 static void
-unwind_macro (gcj::unit* unit, source_location loc,
+unwind_macro (gcj::set* set, source_location loc,
 	      gcj::macro_stack* stack, const char* prefix)
 {
   if (loc <= BUILTINS_LOCATION)
     return;
 
-  source_location w = loc;
-  const line_map* m;
-  for (m = linemap_lookup (line_table, w);
-       linemap_macro_expansion_map_p (m);
-       w = linemap_unwind_toward_expansion (line_table, w, &m))
+  const line_map* m = linemap_lookup (line_table, loc);
+  if (! linemap_macro_expansion_map_p (m))
+    return;
+
+  plug_data* plug = (plug_data*) set->cur_data;
+
+  source_location l =
+    linemap_resolve_location (line_table, loc,
+			      LRK_MACRO_DEFINITION_LOCATION,
+			      NULL);
+  set->trace ("  %s, expanded from %s:%d,%d\n",
+	      prefix,
+	      LOCATION_FILE (l), LOCATION_LINE (l),
+	      LOCATION_COLUMN (l));
+
+  stack->add (gcj::expansion_point (unwind_include (set, l, prefix),
+				    build_file_location (l)));
+
+  const line_map* w = m;
+  source_location next = linemap_unwind_toward_expansion (line_table,
+							  loc, &w);
+  if (plug->macros.find (next) == plug->macros.end ())
     {
-      source_location l =
-	linemap_resolve_location (line_table, w,
-				  LRK_MACRO_DEFINITION_LOCATION,
-				  NULL);
-      unit->trace ("  %s, expanded from %s:%d,%d\n",
-		   prefix,
-		   LOCATION_FILE (l), LOCATION_LINE (l),
-		   LOCATION_COLUMN (l));
-
-      gcj::source_stack include;
-      unwind_include (unit, l, &include, prefix);
-
-      stack->add (gcj::expansion_point (unit->include_id (include),
-					build_source_location (unit, l)));
+      gcj::macro_stack outer;
+      unwind_macro (set, next, &outer, prefix);
+      plug->macros.insert (std::make_pair (next, outer));
     }
+
+  const gcj::macro_stack* outer = &plug->macros.find (next)->second;
+  stack->points.insert (stack->points.end (),
+			outer->points.begin (), outer->points.end ());
 }
 
 static void
-unwind (gcj::unit* unit, source_location loc,
+unwind (gcj::set* set, source_location loc,
 	gcj::unwind_stack* stack, const char* prefix)
 {
-  unwind_macro (unit, loc, &stack->macro, prefix);
-  unwind_include (unit, loc, &stack->include, prefix);
+  unwind_macro (set, loc, &stack->macro, prefix);
+  stack->include = unwind_include (set, loc, prefix);
 }
 
 static std::string
@@ -305,7 +336,7 @@ lex_token (gcj::set* set,
   plug_data* plug = (plug_data*) set->cur_data;
 
   gcj::unwind_stack stack;
-  unwind_macro (unit, loc, &stack.macro, "cpp_token");
+  unwind_macro (set, loc, &stack.macro, "cpp_token");
 
   if (stack.macro.length () == 0)
     return;
@@ -319,9 +350,9 @@ lex_token (gcj::set* set,
 	      expand_location_to_spelling_point (loc).line,
 	      expand_location_to_spelling_point (loc).column);
 
-  unwind_include (unit, loc, &stack.include, "cpp_token");
+  stack.include = unwind_include (set, loc, "cpp_token");
 
-  gcj::context* ctx = unit->get (unit->include_id (stack.include));
+  gcj::context* ctx = unit->get (stack.include);
   gcj::jump_to* to = ctx->jump (unit, build_file_location (loc), 0);
   if (to && to->exp)
     unit->get_expansion (to->exp)->add (token,
@@ -365,7 +396,7 @@ build_ref_jump_to (int unit_id, const gcj::unwind_stack& stack,
   gcj::file_location file_loc (build_file_location (loc));
   gcj::unit* unit = set->current ();
   const plug_data* plug = (plug_data*) set->cur_data;
-  int include = unit->include_id (stack.include);
+  int include = stack.include;
   if (stack.macro.length () == 0)
     *to = gcj::jump_to (unit_id, include, 0, file_loc);
   else
@@ -383,6 +414,7 @@ static void
 build_ref (gcj::set* set, const_tree ref, source_location loc)
 {
   gcj::unit* unit = set->current();
+  plug_data* plug = (plug_data*) set->cur_data;
 
   source_location from_loc = loc;
   source_location to_loc = DECL_SOURCE_LOCATION (ref);
@@ -401,16 +433,16 @@ build_ref (gcj::set* set, const_tree ref, source_location loc)
 	      LOCATION_COLUMN (from_loc));
 
   gcj::unwind_stack from_stack;
-  unwind (unit, from_loc, &from_stack, "refer");
+  unwind (set, from_loc, &from_stack, "refer");
 
-  int include_id = unit->include_id (from_stack.include);
+  int include_id = from_stack.include;
   gcj::context* ctx = unit->get (include_id);
   gcj::jump_from jump_from;
   build_ref_jump_from (from_loc, strlen (name), set,
 		       ctx, from_stack.macro, &jump_from);
 
   gcj::unwind_stack to_stack;
-  unwind (unit, to_loc, &to_stack, "declare");
+  unwind (set, to_loc, &to_stack, "declare");
 
   gcj::jump_to jump_to;
   build_ref_jump_to (set->current_id (), to_stack,
@@ -418,8 +450,8 @@ build_ref (gcj::set* set, const_tree ref, source_location loc)
 
   // Add a jump from the reference to the declaration
   ctx->add (jump_from, jump_to);
-  add_back (set->current_id (), include_id, 0,
-            jump_from, unit, jump_to);
+  plug->backs.push_back (gcj::back_edge (set->current_id (), include_id, 0,
+					 jump_from, jump_to));
 }
 
 static void
@@ -427,6 +459,7 @@ expand_macro (gcj::set* set, const cpp_token* token,
 	      source_location loc, source_location macro_loc)
 {
   gcj::unit* unit = set->current ();
+  plug_data* plug = (plug_data*) set->cur_data;
 
   source_location from_loc = loc;
   source_location to_loc = macro_loc;
@@ -443,13 +476,13 @@ expand_macro (gcj::set* set, const cpp_token* token,
 	      expand_location_to_spelling_point (from_loc).column);
 
   gcj::unwind_stack from_stack;
-  unwind (unit, from_loc, &from_stack, "macro");
+  unwind (set, from_loc, &from_stack, "macro");
 
   source_location spell_loc;
   spell_loc = linemap_resolve_location (line_table, from_loc,
 				       LRK_SPELLING_LOCATION, NULL);
   gcj::unwind_stack spell_stack;
-  unwind (unit, spell_loc, &spell_stack, "macro_spell");
+  unwind (set, spell_loc, &spell_stack, "macro_spell");
 
   // TOFIX better handle pasting
   if (token->flags & PASTED)
@@ -459,8 +492,8 @@ expand_macro (gcj::set* set, const cpp_token* token,
     }
 
   gcj::context* ctx;
-  gcj::expansion_point point (unit->include_id (from_stack.include),
-			      build_source_location (unit, from_loc));
+  gcj::expansion_point point (from_stack.include,
+			      build_file_location (from_loc));
   int eid = unit->point_id (point);
 
   if (from_stack.macro.length () == 0)
@@ -476,10 +509,10 @@ expand_macro (gcj::set* set, const cpp_token* token,
   int include_id;
   int point_id = 0;
   if (from_stack.macro.length () == 0)
-    ctx = unit->get (include_id = unit->include_id (from_stack.include));
+    ctx = unit->get (include_id = from_stack.include);
   else
     //ctx = unit->get (from_stack.macro.front()->include, eid);
-    ctx = unit->get (include_id = unit->include_id (spell_stack.include),
+    ctx = unit->get (include_id = spell_stack.include,
                      point_id = eid);
 
   set->trace ("enter_macro_context, macro %s defined at %s:%d,%d\n",
@@ -488,12 +521,12 @@ expand_macro (gcj::set* set, const cpp_token* token,
 	      LOCATION_COLUMN (to_loc));
 
   gcj::unwind_stack to_stack;
-  unwind (unit, to_loc, &to_stack, "define");
+  unwind (set, to_loc, &to_stack, "define");
   assert (to_stack.macro.length () == 0);
 
   gcj::jump_from jump_from (build_file_location (spell_loc),
 			    strlen (name));
-  int to_include = unit->include_id (to_stack.include);
+  int to_include = to_stack.include;
   // Touch the context so it gets surrounding
   unit->get (to_include, eid);
 
@@ -510,8 +543,8 @@ expand_macro (gcj::set* set, const cpp_token* token,
   // Add a jump from the macro expansion point to the
   // declaration
   ctx->add (jump_from, jump_to);
-  add_back (set->current_id (), include_id, point_id,
-            jump_from, unit, jump_to);
+  plug->backs.push_back (gcj::back_edge (set->current_id (), include_id,
+					 point_id, jump_from, jump_to));
 }
 
 static void
@@ -525,18 +558,14 @@ stack_file (gcj::set* set, source_location loc, const char* file)
 	      LOCATION_COLUMN (loc), file);
 
   gcj::unwind_stack stack;
-  unwind (unit, loc, &stack, "stack");
+  unwind (set, loc, &stack, "stack");
 
-  gcj::context* ctx = unit->get (unit->include_id (stack.include));
+  gcj::context* ctx = unit->get (stack.include);
   assert (LOCATION_COLUMN (loc) == 0);
   gcj::jump_from jump_from (build_file_location (loc), 0);
 
-  gcj::source_stack to;
-  to.add (gcj::source_location (unit->file_id (file)));
-  to.add (build_source_location (unit, loc));
-  to.locs.insert (to.locs.end (),
-		  stack.include.locs.begin () + 1,
-		  stack.include.locs.end ());
+  gcj::source_stack to (unit->file_id (file),
+			build_file_location (loc), stack.include);
   gcj::jump_to jump_to (set->current_id (),
 			unit->include_id (to), 0,
 			gcj::file_location ());
@@ -612,8 +641,8 @@ resolve_tags (gcj::set* set, plug_data* plug)
 
       // build jump_from from jt->first
       gcj::unwind_stack from_stack;
-      unwind (unit, jt->first, &from_stack, "ref_tag_from");
-      int include_id = unit->include_id (from_stack.include);
+      unwind (set, jt->first, &from_stack, "ref_tag_from");
+      int include_id = from_stack.include;
       gcj::context* ctx = unit->get (include_id);
       gcj::jump_from jump_from;
       build_ref_jump_from (jt->first, strlen (name), set,
@@ -624,12 +653,13 @@ resolve_tags (gcj::set* set, plug_data* plug)
 	  // Add a jump from the tag's reference to the declaration
 	  const gcj::jump_to& jump_to = tos.find (kt->second)->second;
 	  ctx->add (jump_from, jump_to);
-	  add_back (unit_id, include_id, 0, jump_from, unit, jump_to);
+	  plug->backs.push_back (gcj::back_edge (unit_id, include_id, 0,
+						 jump_from, jump_to));
 	  continue;
 	}
 
       gcj::unwind_stack to_stack;
-      unwind (unit, kt->second, &to_stack, "ref_tag_to");
+      unwind (set, kt->second, &to_stack, "ref_tag_to");
 
       gcj::jump_to jump_to;
       build_ref_jump_to (set->current_id (), to_stack,
@@ -637,7 +667,8 @@ resolve_tags (gcj::set* set, plug_data* plug)
       // Add a jump from the tag's reference to the declaration
       // with new target
       ctx->add (jump_from, jump_to);
-      add_back (unit_id, include_id, 0, jump_from, unit, jump_to);
+      plug->backs.push_back (gcj::back_edge (unit_id, include_id, 0,
+					     jump_from, jump_to));
       tos.insert (std::make_pair (kt->second, jump_to));
     }
 }
@@ -731,9 +762,9 @@ add_declaration (gcj::set* set, tree decl)
   const char* name = IDENTIFIER_POINTER (DECL_NAME (decl));
 
   gcj::unwind_stack stack;
-  unwind (unit, loc, &stack, "add_decl");
+  unwind (set, loc, &stack, "add_decl");
 
-  int include = unit->include_id (stack.include);
+  int include = stack.include;
   gcj::jump_from jump_from;
   build_ref_jump_from (loc, strlen (name), set,
 		       unit->get (include), stack.macro, &jump_from);
@@ -755,7 +786,7 @@ add_definition (gcj::set* set, tree decl)
   const char* name = IDENTIFIER_POINTER (DECL_NAME (decl));
 
   gcj::unwind_stack stack;
-  unwind (unit, loc, &stack, "add_decl");
+  unwind (set, loc, &stack, "add_decl");
 
   gcj::jump_to jump_to;
   build_ref_jump_to (unit_id, stack, loc, set, &jump_to);
@@ -826,6 +857,7 @@ plugin_init (plugin_name_args* plugin_info,
 
   const char* db = NULL;
   int flags = 0;
+  int compress = 0;
   for (int i = 0; i < plugin_info->argc; ++ i)
     if (strcmp (plugin_info->argv[i].key, "db") == 0)
       db = plugin_info->argv[i].value;
@@ -833,6 +865,11 @@ plugin_init (plugin_name_args* plugin_info,
       flags |= gcj::SF_TRACE;
     else if (strcmp (plugin_info->argv[i].key, "dump") == 0)
       flags |= gcj::SF_DUMP;
+    else if (strcmp (plugin_info->argv[i].key, "paths") == 0)
+      flags |= gcj::SF_PATHS;
+    else if (strcmp (plugin_info->argv[i].key, "compress") == 0)
+      compress = plugin_info->argv[i].value
+		 ? atoi (plugin_info->argv[i].value) : 1;
 
   if (! db)
     {
@@ -840,7 +877,13 @@ plugin_init (plugin_name_args* plugin_info,
       return 1;
     }
 
-  gcj::set* set = new gcj::set (db, flags);
+  if (compress < 0 || compress > 9)
+    {
+      fprintf (stderr, "GCJ compression level is 0 to 9\n");
+      return 1;
+    }
+
+  gcj::set* set = new gcj::set (db, flags, compress);
 
   set->trace ("hello plugin\n");
   register_callback (plugin_info->base_name,